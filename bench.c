@@ -0,0 +1,317 @@
+// BENCHMARK OF THE MOSS PIPELINE
+// generates a reproducible synthetic corpus, then times each stage of the pipeline on it separately:
+// traversal (directoryWorker), tokenization (WFDmain), the pair kernel (JSDhelper) and sorting/printing the results.
+// built with optimizations and without ASan by `make bench`, which also runs it. ./bench -h lists the parameters
+
+#define BENCHMARK  // main.c leaves its main() out
+#include "main.c"
+
+#include <time.h>
+#include <getopt.h>
+
+#define BENCHGROUPSIZE 4  // files sharing one source text, the ones that overlap
+#define BENCHWORDSPERLINE 12
+
+// Benchmark parameters
+struct benchOptions {
+    int files;  // -n
+    int wordsPerFile;  // -s
+    int vocabularySize;  // -v
+    double zipfSkew;  // -z, exponent of the word rank distribution
+    double overlap;  // -o, fraction of a file's words copied from its group's source text
+    unsigned long long seed;  // -r
+    int repeats;  // -i, every stage is timed this many times and the best time reported
+    char *directory;  // -d, where the corpus is written
+};
+
+// the walk fills a bounded queue, so something has to drain it while it runs
+struct benchDrainArgs {
+    struct queue *files;
+    char **names;
+    int count;
+    int capacity;
+};
+
+// ------------------------------- CORPUS GENERATOR -------------------------------
+
+// splitmix64, so the corpus only depends on the seed
+static unsigned long long benchRandom(unsigned long long *state) {
+    return hashId((*state)++);
+}
+
+// the starting state of random stream number index of one kind (files or group sources). consecutive states only
+// differ by one step, so the index is mixed in instead of added: two streams never run into each other
+static unsigned long long benchStream(unsigned long long seed, unsigned long long kind, int index) {
+    return hashId(hashId(seed ^ kind) ^ ((unsigned long long) index * 0x9e3779b97f4a7c15ULL));
+}
+
+static double benchUniform(unsigned long long *state) {
+    return (benchRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// cumulative distribution of word ranks 1..vocabularySize with weights 1 / rank^skew
+static double *zipfTable(int vocabularySize, double skew) {
+    double *cdf = malloc(vocabularySize * sizeof(double));
+    if (cdf == NULL) {
+        err(1, "out of memory");
+    }
+    double sum = 0.0;
+    for (int rank = 0; rank < vocabularySize; rank++) {
+        sum += 1.0 / pow(rank + 1, skew);
+        cdf[rank] = sum;
+    }
+    for (int rank = 0; rank < vocabularySize; rank++) {
+        cdf[rank] /= sum;
+    }
+    return cdf;
+}
+
+static int zipfSample(double *cdf, int vocabularySize, unsigned long long *state) {
+    double u = benchUniform(state);
+    int low = 0, high = vocabularySize - 1;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (cdf[middle] < u) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// the word of a rank, spelled in base 26 so words have different lengths like real ones
+static void benchWord(int rank, char *word) {
+    int length = 0;
+    char reversed[16];
+    do {
+        reversed[length++] = 'a' + rank % 26;
+        rank /= 26;
+    } while (rank > 0);
+    for (int i = 0; i < length; i++) {
+        word[i] = reversed[length - 1 - i];
+    }
+    word[length] = '\0';
+}
+
+// writes the corpus: files spread over ten subdirectories, in groups of BENCHGROUPSIZE that copy part of their
+// words from one shared source text. returns the number of bytes written
+long long generateCorpus(struct benchOptions *opts) {
+    if (mkdir(opts->directory, 0777) == -1 && errno != EEXIST) {
+        err(1, "can't create %s", opts->directory);
+    }
+    double *cdf = zipfTable(opts->vocabularySize, opts->zipfSkew);
+    int *source = malloc(opts->wordsPerFile * sizeof(int));
+    if (source == NULL) {
+        err(1, "out of memory");
+    }
+
+    long long bytes = 0;
+    char path[FILENAME_MAX], word[16];
+    for (int i = 0; i < opts->files; i++) {
+        // every file's words depend only on the seed and the file's number
+        unsigned long long state = benchStream(opts->seed, 0xbf58476d1ce4e5b9ULL, i / BENCHGROUPSIZE);
+        for (int w = 0; w < opts->wordsPerFile; w++) {
+            source[w] = zipfSample(cdf, opts->vocabularySize, &state);
+        }
+        state = benchStream(opts->seed, 0x94d049bb133111ebULL, i);
+
+        snprintf(path, sizeof(path), "%s/d%d", opts->directory, i % 10);
+        if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+            err(1, "can't create %s", path);
+        }
+        snprintf(path, sizeof(path), "%s/d%d/f%05d.txt", opts->directory, i % 10, i);
+        FILE *out = fopen(path, "w");
+        if (out == NULL) {
+            err(1, "can't write %s", path);
+        }
+        for (int w = 0; w < opts->wordsPerFile; w++) {
+            int rank = benchUniform(&state) < opts->overlap ? source[w] : zipfSample(cdf, opts->vocabularySize, &state);
+            benchWord(rank, word);
+            // some capitals and punctuation so the tokenizer does its whole job
+            if (benchRandom(&state) % 16 == 0) word[0] = toupper(word[0]);
+            char separator = (w + 1) % BENCHWORDSPERLINE == 0 ? '\n' : benchRandom(&state) % 10 == 0 ? ',' : ' ';
+            bytes += fprintf(out, "%s%c", word, separator);
+        }
+        fclose(out);
+    }
+    free(source);
+    free(cdf);
+    return bytes;
+}
+
+// ------------------------------- END OF CORPUS GENERATOR -------------------------------
+
+// ------------------------------- TIMING -------------------------------
+
+static double benchNow(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static int cmpNames(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static void *benchDrain(void *arg) {
+    struct benchDrainArgs *args = arg;
+    char *name;
+    while (queue_remove(args->files, &name) == EXIT_SUCCESS) {
+        if (args->count == args->capacity) {
+            args->capacity = args->capacity ? args->capacity * 2 : 1024;
+            args->names = realloc(args->names, args->capacity * sizeof(char *));
+            if (args->names == NULL) {
+                err(1, "out of memory");
+            }
+        }
+        args->names[args->count++] = name;
+    }
+    return NULL;
+}
+
+// walks the corpus with one walker on this thread, returning the seconds it took. *names gets the files found
+double benchWalk(char *directory, struct pathStore *paths, char ***names, int *count) {
+    struct queue Q;
+    queue_init(&Q, paths);
+    struct benchDrainArgs drain = { &Q, NULL, 0, 0 };
+    pthread_t drainer;
+    startThreads(&drainer, 1, benchDrain, &drain, 0);
+
+    double start = benchNow();
+    struct walkPool walks;
+    walkPool_init(&walks, 1, &Q, DEFAULTSUFFIX, WS_DEFAULT);
+    walkPool_push(&walks, 0, directory);
+    walkPool_close(&walks);
+    struct walkerArgs walker = { &walks, 0 };
+    directoryWorker(&walker);
+    walkPool_destroy(&walks);
+    queue_close(&Q);
+    joinThreads(&drainer, 1);
+    double seconds = benchNow() - start;
+
+    // the same order every time, whatever order readdir gave
+    qsort(drain.names, drain.count, sizeof(char *), cmpNames);
+    *names = drain.names;
+    *count = drain.count;
+    return seconds;
+}
+
+static void benchReport(const char *stage, double seconds, double amount, const char *unit) {
+    printf("%-14s %10.3f ms %14.0f %s/s\n", stage, seconds * 1e3, seconds > 0 ? amount / seconds : 0.0, unit);
+}
+
+// ------------------------------- END OF TIMING -------------------------------
+
+static void usage(void) {
+    fprintf(stderr, "usage: bench [-n files] [-s words per file] [-v vocabulary size] [-z zipf skew]\n"
+                    "             [-o overlap rate] [-r seed] [-i repeats] [-d corpus directory]\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct benchOptions opts = { 200, 2000, 20000, 1.0, 0.3, 1, 3, "bench_corpus" };
+    int option;
+    while ((option = getopt(argc, argv, "n:s:v:z:o:r:i:d:h")) != -1) {
+        switch (option) {
+            case 'n': opts.files = atoi(optarg); break;
+            case 's': opts.wordsPerFile = atoi(optarg); break;
+            case 'v': opts.vocabularySize = atoi(optarg); break;
+            case 'z': opts.zipfSkew = atof(optarg); break;
+            case 'o': opts.overlap = atof(optarg); break;
+            case 'r': opts.seed = strtoull(optarg, NULL, 10); break;
+            case 'i': opts.repeats = atoi(optarg); break;
+            case 'd': opts.directory = optarg; break;
+            default:
+                usage();
+                return EXIT_FAILURE;
+        }
+    }
+    if (opts.files < 2 || opts.wordsPerFile < 1 || opts.vocabularySize < 1 || opts.repeats < 1
+        || opts.overlap < 0.0 || opts.overlap > 1.0) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    JSDkernel_select();
+
+    double start = benchNow();
+    long long bytes = generateCorpus(&opts);
+    printf("corpus: %d files, %d words each, vocabulary %d, zipf %.2f, overlap %.2f, seed %llu, %lld bytes (%.0f ms)\n",
+           opts.files, opts.wordsPerFile, opts.vocabularySize, opts.zipfSkew, opts.overlap, opts.seed, bytes,
+           (benchNow() - start) * 1e3);
+    printf("best of %d\n", opts.repeats);
+
+    double walkTime = INFINITY, WFDTime = INFINITY, matrixTime = INFINITY, JSDTime = INFINITY, outputTime = INFINITY;
+    long long pairs = 0, words = 0;
+    for (int repeat = 0; repeat < opts.repeats; repeat++) {
+        // a fresh vocabulary every time, so later repeats don't find every word already interned
+        vocabulary_init(&vocab);
+        struct pathStore paths;
+        pathStore_init(&paths);
+        char **names;
+        int count;
+        double seconds = benchWalk(opts.directory, &paths, &names, &count);
+        if (seconds < walkTime) walkTime = seconds;
+
+        struct WFDrepository repo;
+        WFDqueueinit(&repo);
+        words = 0;
+        start = benchNow();
+        for (int i = 0; i < count; i++) {
+            struct WFD wfd;
+            int wordCount = WFDmain(names[i], &wfd);
+            WFDqueue_set(&repo, WFDqueue_reserve(&repo, names[i]), &wfd, wordCount);
+            words += wordCount;
+        }
+        seconds = benchNow() - start;
+        if (seconds < WFDTime) WFDTime = seconds;
+
+        start = benchNow();
+        struct termDocMatrix matrix;
+        termDocMatrix_build(&matrix, &repo, 1, 0);
+        seconds = benchNow() - start;
+        if (seconds < matrixTime) matrixTime = seconds;
+
+        // every pair on one thread, straight through JSDhelper
+        struct JSDbuffer results = { .maxJSD = INFINITY };
+        start = benchNow();
+        for (int i = 0; i < (int) repo.count; i++) {
+            for (int j = i + 1; j < (int) repo.count; j++) {
+                JSDhelper(&repo.data[i], &repo.data[j], i, j, repo.wordCounts[i], repo.wordCounts[j], &results);
+            }
+        }
+        seconds = benchNow() - start;
+        if (seconds < JSDTime) JSDTime = seconds;
+        pairs = results.count;
+
+        FILE *sink = fopen("/dev/null", "w");
+        if (sink == NULL) {
+            err(1, "can't open /dev/null");
+        }
+        start = benchNow();
+        qsort(results.data, results.count, sizeof(struct JSDrepository), cmp);
+        for (long long i = 0; i < results.count; i++) {
+            printJSDResult(sink, &results.data[i], &repo);
+        }
+        fflush(sink);
+        seconds = benchNow() - start;
+        if (seconds < outputTime) outputTime = seconds;
+        fclose(sink);
+
+        free(results.data);
+        termDocMatrix_destroy(&matrix);
+        WFDqueue_destroy(&repo);
+        free(names);
+        pathStore_destroy(&paths);
+        vocabulary_destroy(&vocab);
+    }
+
+    benchReport("walk", walkTime, opts.files, "files");
+    benchReport("WFDmain", WFDTime, bytes, "bytes");
+    benchReport("", WFDTime, words, "words");
+    benchReport("matrix", matrixTime, opts.files, "files");
+    benchReport("JSDhelper", JSDTime, pairs, "pairs");
+    benchReport("sort/output", outputTime, pairs, "pairs");
+    return EXIT_SUCCESS;
+}
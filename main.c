@@ -7,7 +7,6 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <dirent.h>
-#include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,6 +20,13 @@
 #include<sys/types.h>
 #include<sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <limits.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 enum {
     WALK_OK = 0,
@@ -35,182 +41,740 @@ enum {
 #define WS_DEFAULT	WS_RECURSIVE
 #define WS_FOLLOWLINK	(1 << 1)	/* follow symlinks */
 #define WS_DOTFILES	(1 << 2)	/* per unix convention, .file is hidden */
-#define WS_MATCHDIRS	(1 << 3)	/* if pattern is used on dir names too */
+#define DEFAULTSUFFIX ".txt"  // what the names of files found in directories end with, unless -sS says otherwise
+#define WALKDEQUESIZE 64  // initial capacity of a walker's deque
+#define INODESETSIZE 1024  // initial slot count of an inode set, must be a power of two
 #define QUEUESIZE 1000
 #define STRINGSIZE 1000
-#define REPOSITORYSIZE 1000
+#define REPOSITORYSIZE 1000  // initial capacity, the repository grows as needed
+#define ARENACHUNKSIZE (1 << 16)
+#define PATHTABLESIZE 1024  // initial slot count of the path store's hash table, must be a power of two
+#define WORDSIZE 100
+#define READBLOCKSIZE (1 << 16)  // read() size for files that can't be memory mapped
+#define TOKENIZERVERSION 1  // bump whenever tokenizer_feed changes what a word is, it invalidates every cached WFD
+#define WFDCACHE_MAGIC "WFDCACHE"
+#define WFDINDEX_MAGIC "WFDINDEX"
+#define WFDINDEXVERSION 1
+#define VOCABULARYSIZE 4096  // initial number of vocabulary ids, grows as needed
+#define WFDTABLESIZE 1024  // initial slot count of a WFD hash table, must be a power of two
+#define WFDALIGNMENT 64  // WFD arrays start on cache line boundaries
+#define GALLOPRATIO 8  // JSDhelper gallops through a WFD this many times longer than the other one
+#define JSDBLOCKSIZE 256  // shared words gathered per call of the JSD kernel
 #define DEBUG_QUEUETEST 0
-#define DEBUG_LLTEST 0
 #define DEBUG_WFD 0
 #define DEBUG 0
 #define DEBUG_JSD 0
 #define COMBINATIONGENERATOR 1
+#define DEFAULTTHREADS 1  // threads per stage when no -dN / -fN / -aN is given
+#define PAIRCHUNKSPERTHREAD 16
+#define STREAMWINDOW 4096  // results an analysis thread sorts and writes at once with --stream
+#define TILEBYTES (128 * 1024)  // per tile, two tiles should sit in L2 together
+#define DENSETHRESHOLD 0.25  // fraction of non-zero cells above which the term-document matrix is also kept dense
+#define DENSEMATRIXBYTES (256LL * 1024 * 1024)  // never build dense rows bigger than this
+#define LSHROWS 4  // MinHash values per LSH band
+#define LSHMAXBANDS 256
 #define PRODUCTIONTEST 1
 #define DEBUG_FILEHANDLING 0
 
+// Arena struct, a bump allocator for strings that live until the end of the run
+struct arenaChunk {
+    struct arenaChunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+struct arena {
+    struct arenaChunk *chunks;  // the chunk being filled, older ones follow
+};
+
+// Path store struct
+// every path that enters a queue is interned here once, so queues and the repository only pass pointers around
+// and a path that shows up twice is caught with one hash lookup
+struct pathStore {
+    struct arena strings;
+    char **slots;  // open addressing table of interned paths
+    size_t capacity;  // always a power of two
+    size_t count;
+    pthread_mutex_t lock;
+};
+
+// Inode set struct
+// remembers which (st_dev, st_ino) pairs have been seen, so a directory reached twice (named twice, or through a
+// symlink back up the tree) is only walked once
+struct inodeKey {
+    dev_t dev;
+    ino_t ino;  // 0 marks an empty slot, no file has it
+};
+
+struct inodeSet {
+    struct inodeKey *slots;  // open addressing table
+    size_t capacity;  // always a power of two
+    size_t count;
+    pthread_mutex_t lock;
+};
+
 // Queue struct
+// bounded channel of interned paths, producers block while it is full and consumers drain it concurrently
 struct queue {
-    char data[QUEUESIZE][STRINGSIZE];
+    char *data[QUEUESIZE];
+    struct pathStore *paths;  // where added items are interned
+    struct inodeSet *inodes;  // files queued so far by (st_dev, st_ino), NULL to only weed out repeated paths
     unsigned head;  // index of first item in queue
     unsigned count;  // number of items in queue
     pthread_mutex_t lock;
     pthread_cond_t read_ready;  // wait for count > 0
     pthread_cond_t write_ready; // wait for count < QUEUESIZE
+    int closed;  // set once no more items will be added
 };
 
 // WFDrepository struct
+// file reader threads reserve a slot per file and fill it in once the WFD is built. grows as needed.
 struct WFDrepository {
-    struct Node * data[REPOSITORYSIZE];
-    char fileNames[REPOSITORYSIZE][STRINGSIZE];
+    struct WFD *data;
+    char **fileNames;  // interned in the path store
+    int *wordCounts;  // total number of words in each file, counted while its WFD was built
+    unsigned capacity;
     unsigned head;  // index of first item in queue
     unsigned count;  // number of items in queue
+    unsigned ready;  // number of slots whose WFD has been filled in
+    unsigned duplicates;  // files after the first count that are exact copies of one of them, see WFDqueue_group
+    int *nextCopy;  // next file of the same group of copies, -1 ending it. NULL when there are no copies
     pthread_mutex_t lock;
     pthread_cond_t read_ready;  // wait for count > 0
     pthread_cond_t write_ready; // wait for count < REPOSITORYSIZE
 };
 
 struct JSDrepository {  //this thing stores a the JSD calculation and a wordcount
-    char string[2500];
-    int wordCount;
+    int file1;  // repository indexes, names are only looked up when the result is printed
+    int file2;
+    double JSD;
+    long long wordCount;
+};
+
+// Vocabulary struct
+// every distinct word of the run gets a dense integer id, so WFDs are sorted by id and compared with integer compares
+struct vocabulary {
+    struct arena strings;
+    char **words;  // id -> word
+    unsigned count;  // number of distinct words, also the next id
+    unsigned capacity;  // of words
+    unsigned *slots;  // open addressing table of id + 1, 0 marks an empty slot
+    size_t tableCapacity;  // always a power of two
+    pthread_mutex_t lock;
 };
 
-// Linked List struct
-struct Node {
-    char data[100];
+// WFD struct, the word frequency distribution of one file as parallel arrays sorted by vocabulary id.
+// the three arrays share one cache-line aligned allocation, so the JSD kernel streams through them linearly.
+struct WFD {
+    double *frequencies;
+    double *selfTerms;  // p * log2(p) of each word, the part of the KLD that doesn't depend on the other file
+    unsigned *ids;  // vocabulary ids, ascending
+    int *wordCounts;
+    int count;  // number of distinct words
+    double total;  // sum of the frequencies, 1 up to rounding
+    void *block;  // allocation holding the arrays, NULL when they belong to someone else (a term-document matrix)
+    unsigned long long contentHash;  // of the file it was built from, 0 when unknown (a WFD index document)
+};
+
+// WFD hash table struct, counts the words of one file before they are given vocabulary ids
+struct WFDslot {
+    char *word;  // NULL marks an empty slot
     long long wordCount;
-    double frequency;
-    struct Node* next;
+};
+
+struct WFDtable {
+    struct WFDslot *slots;
+    size_t capacity;  // always a power of two
+    size_t count;  // number of distinct words
+    struct arena words;  // copies of the words, freed with the table
+};
+
+// Tokenizer state, carried across the blocks of one file
+struct tokenizer {
+    char word[WORDSIZE];
+    int endOfWordIndex;
+    int ENDWORDFLAG;
+    int totalNumberOfWords;
+    void (*emit)(void *ctx, char *word);  // called once per word, may be NULL when only counting
+    void *ctx;
+};
+
+// File contents struct
+// the whole of a file in memory, mapped when it can be
+struct fileContents {
+    char *data;
+    size_t length;
+    int mapped;
+};
+
+// Content hash struct
+// a 64 bit hash of a file fed in blocks of any size, 8 bytes at a time with the leftovers carried to the next block
+struct contentHash {
+    unsigned long long state;
+    unsigned long long length;
+    unsigned char tail[8];
+    int tailLength;
+};
+
+// WFD cache file header, followed by one entry per distinct word: its length as one byte, its characters and its
+// count as an int
+struct WFDcacheHeader {
+    char magic[8];  // WFDCACHE_MAGIC
+    unsigned version;  // TOKENIZERVERSION
+    unsigned words;  // distinct words
+    unsigned long long contentHash;
+    unsigned long long contentLength;
+    long long totalWords;
+};
+
+// WFD index file header
+// a whole repository of WFDs in one file that is memory mapped and used in place: the vocabulary, the file names
+// and every document's arrays exactly as the term-document matrix keeps them. each section starts on a
+// WFDALIGNMENT boundary, its position given in bytes from the start of the file.
+struct WFDindexHeader {
+    char magic[8];  // WFDINDEX_MAGIC
+    unsigned version;  // WFDINDEXVERSION
+    unsigned tokenizerVersion;  // TOKENIZERVERSION of the run that wrote it
+    long long documents;
+    long long vocabularySize;
+    long long nonZeros;  // entries over all documents
+    long long wordOffsets;  // vocabularySize + 1 long longs, word id's string starts at wordStrings + wordOffsets[id]
+    long long wordStrings;  // '\0' terminated, in id order
+    long long nameOffsets;  // documents + 1 long longs into names
+    long long names;
+    long long rows;  // documents + 1 long longs, document i is entries rows[i] to rows[i + 1] - 1
+    long long totalWords;  // documents ints, the files' word counts
+    long long totals;  // documents doubles, the WFDs' totals
+    long long frequencies;  // nonZeros doubles
+    long long selfTerms;  // nonZeros doubles
+    long long ids;  // nonZeros unsigneds, ascending within a document
+    long long counts;  // nonZeros ints
+    long long size;  // of the whole file
+};
+
+// a memory mapped WFD index
+struct WFDindex {
+    char *map;
+    size_t size;
+    struct WFDindexHeader *header;
+};
+
+// Walk deque struct
+// the directories one walker has found and not listed yet. the walker itself works from the back, depth first, while
+// idle walkers steal from the front, where the directories closest to the root (the biggest subtrees) wait
+struct walkDeque {
+    char **data;  // malloc'd paths
+    size_t head;  // first waiting directory
+    size_t tail;  // one past the last
+    size_t capacity;
+    pthread_mutex_t lock;
+};
+
+// Walk pool struct
+// every directory walker and the directories they share out. a walk is over once no directory is waiting, none is
+// being listed and no more will be named on the command line
+struct walkPool {
+    struct walkDeque *deques;  // one per walker
+    int walkers;
+    unsigned next;  // deque the next directory named on the command line goes to
+    struct queue *files;  // where found files are sent
+    char *suffix;
+    size_t suffixLength;
+    int spec;  // WS_ flags
+    struct inodeSet directories;  // every directory listed so far
+    long long waiting;  // directories sitting in a deque
+    long long active;  // directories being listed
+    int closed;  // set once no more directories will be named
+    pthread_mutex_t lock;
+    pthread_cond_t ready;  // wait for waiting > 0 or the end of the walk
+};
+
+// Command line options
+struct options {
+    int directoryThreads;  // -dN
+    int fileThreads;  // -fN
+    int analysisThreads;  // -aN
+    char *suffix;  // -sS, files found in directories are only read when their name ends with S
+    long long top;  // --top K, only the K most similar pairs are printed (0 prints every pair)
+    double maxJSD;  // --max-jsd T, pairs further apart than T are dropped
+    int lshBands;  // --lsh B, only pairs sharing one of B MinHash bands are compared (0 compares every pair)
+    char *cacheDirectory;  // --cache DIR
+    char *indexFile;  // --index FILE, documents to start from
+    int archive;  // set by --archive FILE, which loads FILE like --index but never compares two of its documents
+    char *writeIndexFile;  // --write-index FILE, where to save every document of the run
+    int stream;  // --stream, results are written as they are computed, sorted only within each window
+    int stats;  // --stats, a report of where the time went on stderr
+    char *statsFile;  // --stats-json FILE, the same report as JSON, "-" writes it to stderr
+    int followLinks;  // --follow-links, symlinks found in directories are followed instead of skipped
+};
+
+// phases of a run, each timed separately. traversal and WFD construction overlap: readers start on the first files
+// while the walkers are still looking for more
+enum {
+    PHASE_TRAVERSAL,
+    PHASE_WFD,
+    PHASE_JSD,  // term-document matrix, MinHash filter and every pair
+    PHASE_OUTPUT,  // sorting and printing
+    PHASES
+};
+
+// Run statistics struct, always gathered and reported with --stats / --stats-json.
+// workers add to it atomically once per file or once per thread, never in the pair loop
+struct runStats {
+    double wall[PHASES];  // seconds
+    long long cpu[PHASES];  // nanoseconds over every thread of the phase
+    long long bytesRead;
+    long long tokens;
+    long long distinctWords;  // summed over the files
+    int maxDistinctWords;  // of one file
+    int files;
+    int duplicates;  // files with the exact contents of an earlier one
+    long long pairsEvaluated;
+    long long pairsPruned;  // by the MinHash filter, archive against archive pairs aren't counted
+};
+
+// Thread argument structs
+struct walkerArgs {
+    struct walkPool *pool;
+    int self;  // which deque of the pool is this walker's
+};
+
+struct readerArgs {
+    struct queue *files;
+    struct WFDrepository *repo;
+};
+
+// where streamed results go, shared by every analysis thread
+struct JSDstream {
+    FILE *out;
+    struct WFDrepository *repo;  // for the file names
+    pthread_mutex_t lock;  // one window is written at a time
+};
+
+// growable per-thread list of JSD results, merged into one array before sorting.
+// with a limit it is a heap of the limit most similar pairs seen so far instead, the least similar of them on top.
+// with a stream it is a window of at most STREAMWINDOW results, written out sorted whenever it fills up
+struct JSDbuffer {
+    struct JSDrepository *data;
+    long long count;
+    long long capacity;
+    long long limit;  // 0 keeps every result
+    double maxJSD;  // results above it are dropped
+    struct JSDstream *stream;  // NULL keeps the results until the end
+    int *copies;  // the repository's nextCopy, a result stands for every pair of copies of its two files
+    long long evaluated;  // pairs computed, whether or not they were kept
+};
+
+// Term-document matrix struct
+// every WFD of the run packed into one place for the pairwise phase: always as rows of one contiguous sparse
+// (CSR) block, plus one dense row of frequencies over the whole vocabulary per file when the matrix is dense enough.
+// documents are grouped into tiles small enough that two of them stay in cache while every pair between them is done.
+struct termDocMatrix {
+    int n;  // number of documents
+    unsigned vocabularySize;
+    struct WFD *docs;  // sparse rows, views into the arrays below
+    double *frequencies;  // CSR arrays of all rows back to back
+    double *selfTerms;
+    unsigned *ids;
+    int *wordCounts;
+    int borrowed;  // set when the arrays above belong to someone else (a WFD index)
+    int dense;  // set when values holds the dense rows
+    double *values;  // n rows of stride doubles, zero where a word isn't in the file
+    double *selfValues;  // the same for the self terms
+    size_t stride;
+    int tileSize;  // documents per tile
+    int tiles;  // tiles along each side of the matrix
+    int archived;  // documents 0 to archived - 1 come from an archive and aren't compared with each other
+};
+
+// the combination triangle is numbered row by row, pair 0 being (0, 1), and handed out in chunks of equal pair counts
+struct pairCursor {
+    long long next;  // first pair nobody has claimed yet
+    long long total;  // n * (n - 1) / 2
+    long long chunkSize;
+    pthread_mutex_t lock;
+};
+
+struct analysisArgs {
+    struct WFDrepository *repo;
+    struct termDocMatrix *matrix;
+    struct pairCursor *cursor;  // shared by all analysis threads, counts pairs of tiles (or candidates)
+    unsigned long long *candidates;  // pairs left by the MinHash filter, NULL when every pair is compared
+    struct JSDbuffer results;  // owned by this thread
+};
+
+struct minhashArgs {
+    struct termDocMatrix *matrix;
+    unsigned long long *signatures;  // LSHROWS * bands values per document
+    unsigned long long *wordHashes;  // id -> mix of the word itself
+    int hashes;
+    int start;  // documents start to end - 1 are this thread's
+    int end;
+};
+
+// one document's hash of one band
+struct bandEntry {
+    unsigned long long key;
+    int doc;
 };
 
 // Method headers
 // Basic utility helper methods
-int walk_recur(char *dname, regex_t *reg, int spec, struct queue *Q);
-int walk_dir(char *dname, char *pattern, int spec, struct queue *Q);
-int traverseMain(struct queue *Q, char * currElement);
+int walkPool_init(struct walkPool *W, int walkers, struct queue *files, char *suffix, int spec);
+void walkPool_push(struct walkPool *W, int walker, const char *path);
+int walkPool_take(struct walkPool *W, int walker, char **path);
+void walkPool_done(struct walkPool *W);
+void walkPool_close(struct walkPool *W);
+void walkPool_destroy(struct walkPool *W);
+int walkDirectory(struct walkPool *W, int walker, char *dirName);
+int hasSuffix(const char *name, size_t nameLength, const char *suffix, size_t suffixLength);
 int countNumberOfTextFiles(int argc, char* argv[]);
-int fileManager(struct queue *Q, char * currElement);
-int queue_init(struct queue *Q);
+int fileManager(struct queue *Q, struct walkPool *W, char * currElement);
+int parseOption(int argc, char **argv, int *i, struct options *opts);
+void *arena_alloc(struct arena *A, size_t size);
+char *arena_strdup(struct arena *A, const char *string);
+void arena_destroy(struct arena *A);
+int pathStore_init(struct pathStore *P);
+char *pathStore_intern(struct pathStore *P, const char *path, int *isNew);
+void pathStore_destroy(struct pathStore *P);
+int inodeSet_init(struct inodeSet *S);
+int inodeSet_insert(struct inodeSet *S, dev_t dev, ino_t ino);
+void inodeSet_destroy(struct inodeSet *S);
+int queue_init(struct queue *Q, struct pathStore *paths);
+void queue_close(struct queue *Q);
 int queue_add(struct queue *Q, char * item);
-int queue_remove(struct queue *Q, char *item);
+int queue_addFile(struct queue *Q, char *item, dev_t dev, ino_t ino);
+int queue_remove(struct queue *Q, char **item);
 void queuePrint(struct queue *Q);
-int alreadyExists(struct queue *Q, char * currElement);
-void destroyList(struct Node *head);
-void sortedInsert(struct Node**, struct Node*);
-void insertionSort(struct Node **head_ref);
-void printList(struct Node *head);
-void push(struct Node** head_ref, char* new_data, struct Node* head, int totalNumberOfWords);
 
 // WFD Helper methods
-struct Node * findWords(char *fileName, struct Node *WFD_LL, int totalNumberOfWords);
+int findWords(char *fileName, struct WFD *wfd);
+void tokenizer_feed(struct tokenizer *T, const char *buffer, size_t len);
+int tokenizer_finish(struct tokenizer *T);
+int readFile(char *fileName, void (*consume)(void *ctx, const char *data, size_t len), void *ctx);
+int tokenizeFile(char *fileName, void (*emit)(void *ctx, char *word), void *ctx, unsigned long long *hash);
+int loadFile(char *fileName, struct fileContents *F);
+void unloadFile(struct fileContents *F);
+void contentHash_init(struct contentHash *H);
+void contentHash_feed(struct contentHash *H, const char *data, size_t len);
+unsigned long long contentHash_finish(struct contentHash *H);
+int WFDcache_load(unsigned long long hash, unsigned long long length, struct WFDtable *table);
+void WFDcache_store(unsigned long long hash, unsigned long long length, struct WFDtable *table, int totalNumberOfWords);
+int WFDcache_tokenize(char *fileName, struct WFDtable *table, unsigned long long *hash);
+int WFDindex_write(char *path, struct WFDrepository *repo);
+int WFDindex_open(struct WFDindex *X, char *path);
+void WFDindex_load(struct WFDindex *X, struct WFDrepository *repo, struct pathStore *paths);
+void WFDindex_close(struct WFDindex *X);
 int findNumberOfWords(char * fileName);
-void incrementWordCount(struct Node* head, char* new_data);
-int elementExistsInLL(struct Node* head, char* new_data);
-struct Node * WFDmain(char* fileName, struct Node *WFD_LL);
-void calculateFrequency(struct Node* head, int totalNumberOfWords);
+int WFDmain(char* fileName, struct WFD *wfd);
+void WFD_alloc(struct WFD *wfd, int count);
+int cmpPacked(const void *a, const void *b);
+void WFD_destroy(struct WFD *wfd);
+void printWFD(struct WFD *wfd);
+int vocabulary_init(struct vocabulary *V);
+unsigned vocabulary_intern(struct vocabulary *V, const char *word);
+char *vocabulary_word(struct vocabulary *V, unsigned id);
+void vocabulary_destroy(struct vocabulary *V);
+unsigned long hashWord(const char *word);
+int WFDtable_init(struct WFDtable *T);
+void WFDtable_insert(struct WFDtable *T, char *new_data);
+void WFDtable_add(struct WFDtable *T, char *new_data, long long count);
+void WFDtable_destroy(struct WFDtable *T);
 int WFDqueueinit(struct WFDrepository *Q);
-int WFDqueue_add(struct WFDrepository *Q, struct Node * item, char * fileName);
-int WFDqueue_remove(struct WFDrepository *Q, struct Node * item);
+int WFDqueue_add(struct WFDrepository *Q, struct WFD * item, char * fileName);
+int WFDqueue_reserve(struct WFDrepository *Q, char * fileName);
+void WFDqueue_set(struct WFDrepository *Q, int index, struct WFD * item, int wordCount);
+void WFDqueue_compact(struct WFDrepository *Q);
+int cmpFileName(const void *a, const void *b);
+void WFDqueue_sort(struct WFDrepository *Q, unsigned first);
+int WFD_equal(struct WFD *A, struct WFD *B);
+unsigned WFDqueue_group(struct WFDrepository *Q);
+void WFDqueue_destroy(struct WFDrepository *Q);
 void WFDqueue_print(struct WFDrepository *Q);
 
 // JSD Helper methods
 double average(double frequencyOne, double frequencyTwo, int zeroFlag);
-void traverseWordlist(struct Node *head);
 double calculateKLDSection(double numerator, double denominator);
 double calculateJSDValue(double KLD_1, double KLD_2);
-int JSDhelper(struct Node *WFD_LL_1, struct Node *WFD_LL_2, char * file1, char * file2, struct JSDrepository *array);
-int JSDmain(char * file1, char * file2, struct Node * WFD_LL_1, struct Node * WFD_LL_2, struct JSDrepository *array);
+int JSDhelper(struct WFD *WFD_1, struct WFD *WFD_2, int file1, int file2, int wordCount1, int wordCount2, struct JSDbuffer *results);
+int JSDmain(int file1, int file2, struct WFD * WFD_1, struct WFD * WFD_2, int wordCount1, int wordCount2, struct JSDbuffer *results);
+int WFD_seek(const unsigned *ids, int start, int n, unsigned target);
+int JSDdenseHelper(struct termDocMatrix *M, int file1, int file2, int wordCount1, int wordCount2, struct JSDbuffer *results);
+void JSDrecord(struct JSDbuffer *results, int file1, int file2, double JSD, long long sumOfWords);
+void JSDbuffer_add(struct JSDbuffer *B, int file1, int file2, double JSD, long long sumOfWords);
+void JSDcopies(struct WFDrepository *repo, struct JSDbuffer *results);
+void JSDkernel_scalar(const double *p, const double *q, const double *selfP, const double *selfQ, int n,
+                      double *KLD_1, double *KLD_2);
+void JSDkernel_select(void);
+void termDocMatrix_build(struct termDocMatrix *M, struct WFDrepository *repo, int analysisThreads, int archived);
+void termDocMatrix_pack(struct termDocMatrix *M, struct WFDrepository *repo, long long nonZeros);
+void termDocMatrix_destroy(struct termDocMatrix *M);
+void JSDtile(struct termDocMatrix *M, struct WFDrepository *repo, int tile1, int tile2, struct JSDbuffer *results);
+void JSDpair(struct termDocMatrix *M, struct WFDrepository *repo, int file1, int file2, struct JSDbuffer *results);
+unsigned long long hashId(unsigned long long x);
+void *minhashWorker(void *arg);
+int cmpBandEntry(const void *a, const void *b);
+long long minhash_candidates(struct termDocMatrix *M, int bands, int threads, unsigned long long **pairs);
+struct JSDrepository * JSDbuffer_next(struct JSDbuffer *B);
+void JSDbuffer_keep(struct JSDbuffer *B, struct JSDrepository *record);
+void JSDbuffer_flush(struct JSDbuffer *B);
+int cmpSimilarity(const void *a, const void *b);
+void tilePairFromIndex(long long k, int *tile1, int *tile2);
 int cmp( const void *a, const void *b );
+void printJSDResult(FILE *out, struct JSDrepository *result, struct WFDrepository *repo);
+
+// Thread methods
+void *directoryWorker(void *arg);
+void *fileWorker(void *arg);
+void *analysisWorker(void *arg);
+void startThreads(pthread_t *threads, int count, void *(*routine)(void *), void *arg, size_t argStride);
+void joinThreads(pthread_t *threads, int count);
+
+// Statistics methods
+double stats_clock(clockid_t clock);
+void stats_addThreadCPU(int phase);
+void stats_print(FILE *out, struct runStats *S);
+void stats_printJSON(FILE *out, struct runStats *S);
 
 int totalNumberOfFiles = 0;
-int JSDArrayIndex = 0;
+long long JSDArrayIndex = 0;
+struct vocabulary vocab;  // shared by every file of the run
+char *WFDcacheDirectory = NULL;  // --cache DIR, NULL when WFDs aren't cached
+struct runStats stats;
+void (*JSDkernel)(const double *p, const double *q, const double *selfP, const double *selfQ, int n,
+                  double *KLD_1, double *KLD_2) = JSDkernel_scalar;
 
 // ------------------------------- FILE TRAVERSAL HELPERS -------------------------------
 
-int walk_recur(char *dname, regex_t *reg, int spec, struct queue *Q) {
-    struct dirent *dent;
-    DIR *dir;
-    struct stat st;
-    char fn[FILENAME_MAX];
-    int res = WALK_OK;
-    int len = strlen(dname);
-    if (len >= FILENAME_MAX - 1)
-        return WALK_NAMETOOLONG;
+int walkPool_init(struct walkPool *W, int walkers, struct queue *files, char *suffix, int spec) {
+    W->deques = calloc(walkers, sizeof(struct walkDeque));
+    if (W->deques == NULL) {
+        err(1, "out of memory");
+    }
+    for (int i = 0; i < walkers; i++) {
+        W->deques[i].capacity = WALKDEQUESIZE;
+        W->deques[i].data = malloc(WALKDEQUESIZE * sizeof(char *));
+        if (W->deques[i].data == NULL) {
+            err(1, "out of memory");
+        }
+        pthread_mutex_init(&W->deques[i].lock, NULL);
+    }
+    W->walkers = walkers;
+    W->next = 0;
+    W->files = files;
+    W->suffix = suffix;
+    W->suffixLength = strlen(suffix);
+    W->spec = spec;
+    W->waiting = 0;
+    W->active = 0;
+    W->closed = 0;
+    inodeSet_init(&W->directories);
+    pthread_mutex_init(&W->lock, NULL);
+    pthread_cond_init(&W->ready, NULL);
+    return EXIT_SUCCESS;
+}
+
+// hands a directory to a walker's deque, walker -1 picks one in turn (for directories named on the command line)
+void walkPool_push(struct walkPool *W, int walker, const char *path) {
+    if (walker < 0) {
+        walker = __atomic_fetch_add(&W->next, 1, __ATOMIC_RELAXED) % W->walkers;
+    }
+    char *copy = strdup(path);
+    if (copy == NULL) {
+        err(1, "out of memory");
+    }
+
+    struct walkDeque *D = &W->deques[walker];
+    pthread_mutex_lock(&D->lock);
+    if (D->tail == D->capacity) {
+        // slide down when the front is at least half empty, grow otherwise
+        if (D->head * 2 >= D->capacity) {
+            memmove(D->data, D->data + D->head, (D->tail - D->head) * sizeof(char *));
+            D->tail -= D->head;
+            D->head = 0;
+        }
+        else {
+            D->capacity *= 2;
+            D->data = realloc(D->data, D->capacity * sizeof(char *));
+            if (D->data == NULL) {
+                err(1, "out of memory");
+            }
+        }
+    }
+    D->data[D->tail++] = copy;
+    pthread_mutex_unlock(&D->lock);
+
+    pthread_mutex_lock(&W->lock);
+    W->waiting++;
+    pthread_mutex_unlock(&W->lock);
+    pthread_cond_signal(&W->ready);
+}
+
+// takes a directory off the back (own deque) or the front (someone else's) of D
+static int walkDeque_take(struct walkDeque *D, int back, char **path) {
+    pthread_mutex_lock(&D->lock);
+    if (D->head == D->tail) {
+        pthread_mutex_unlock(&D->lock);
+        return EXIT_FAILURE;
+    }
+    *path = back ? D->data[--D->tail] : D->data[D->head++];
+    if (D->head == D->tail) {
+        D->head = D->tail = 0;
+    }
+    pthread_mutex_unlock(&D->lock);
+    return EXIT_SUCCESS;
+}
+
+// the next directory for walker to list, its own newest first, then the oldest of any other walker.
+// blocks while there is none, returns EXIT_FAILURE once the walk is over. the path is the caller's to free
+int walkPool_take(struct walkPool *W, int walker, char **path) {
+    while (1) {
+        int found = walkDeque_take(&W->deques[walker], 1, path) == EXIT_SUCCESS;
+        for (int k = 1; !found && k < W->walkers; k++) {
+            found = walkDeque_take(&W->deques[(walker + k) % W->walkers], 0, path) == EXIT_SUCCESS;
+        }
+
+        pthread_mutex_lock(&W->lock);
+        if (found) {
+            W->waiting--;
+            W->active++;
+            pthread_mutex_unlock(&W->lock);
+            return EXIT_SUCCESS;
+        }
+        while (W->waiting == 0 && !(W->closed && W->active == 0)) {
+            pthread_cond_wait(&W->ready, &W->lock);
+        }
+        int over = W->waiting == 0;
+        pthread_mutex_unlock(&W->lock);
+        if (over) {
+            return EXIT_FAILURE;
+        }
+    }
+}
+
+// called once a directory taken with walkPool_take is listed, after its subdirectories were pushed
+void walkPool_done(struct walkPool *W) {
+    pthread_mutex_lock(&W->lock);
+    W->active--;
+    int over = W->closed && W->active == 0 && W->waiting == 0;
+    pthread_mutex_unlock(&W->lock);
+    if (over) {
+        pthread_cond_broadcast(&W->ready);
+    }
+}
+
+// no more directories will be named, the walkers stop once the ones they have are listed
+void walkPool_close(struct walkPool *W) {
+    pthread_mutex_lock(&W->lock);
+    W->closed = 1;
+    pthread_mutex_unlock(&W->lock);
+    pthread_cond_broadcast(&W->ready);
+}
+
+void walkPool_destroy(struct walkPool *W) {
+    for (int i = 0; i < W->walkers; i++) {
+        for (size_t j = W->deques[i].head; j < W->deques[i].tail; j++) {
+            free(W->deques[i].data[j]);
+        }
+        free(W->deques[i].data);
+        pthread_mutex_destroy(&W->deques[i].lock);
+    }
+    free(W->deques);
+    inodeSet_destroy(&W->directories);
+    pthread_mutex_destroy(&W->lock);
+    pthread_cond_destroy(&W->ready);
+}
 
-    strcpy(fn, dname);
-    fn[len++] = '/';
+int hasSuffix(const char *name, size_t nameLength, const char *suffix, size_t suffixLength) {
+    return nameLength >= suffixLength && memcmp(name + nameLength - suffixLength, suffix, suffixLength) == 0;
+}
 
-    if (!(dir = opendir(dname))) {
-        warn("can't open %s", dname);
+// lists one directory: files whose name ends with the pool's suffix go to the file queue, subdirectories to the
+// back of this walker's deque. d_type saves a stat per entry, only file systems that leave it unknown and symlinks
+// that are followed need one, relative to the open directory so the path isn't resolved again
+int walkDirectory(struct walkPool *W, int walker, char *dirName) {
+    int fd = open(dirName, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        warn("can't open %s", dirName);
+        return WALK_BADIO;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !inodeSet_insert(&W->directories, st.st_dev, st.st_ino)) {
+        // already listed, through a symlink or under another name
+        close(fd);
+        return WALK_OK;
+    }
+    dev_t dev = st.st_dev;  // of every entry but a followed symlink
+    DIR *dir = fdopendir(fd);
+    if (dir == NULL) {
+        warn("can't open %s", dirName);
+        close(fd);
         return WALK_BADIO;
     }
 
-    errno = 0;
-    while ((dent = readdir(dir))) {
-        if (!(spec & WS_DOTFILES) && dent->d_name[0] == '.')
-            continue;
-        if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+    char path[FILENAME_MAX];
+    size_t length = strlen(dirName);
+    if (length + 2 >= FILENAME_MAX) {
+        closedir(dir);
+        return WALK_NAMETOOLONG;
+    }
+    memcpy(path, dirName, length);
+    path[length++] = '/';
+
+    int res = WALK_OK;
+    struct dirent *dent;
+    // errno is cleared before every readdir, so only a failed one leaves it set when the loop ends
+    for (errno = 0; (dent = readdir(dir)); errno = 0) {
+        char *name = dent->d_name;
+        if (name[0] == '.' && (!(W->spec & WS_DOTFILES) || name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
             continue;
 
-        strncpy(fn + len, dent->d_name, FILENAME_MAX - len);
-        if (lstat(fn, &st) == -1) {
-            warn("Can't stat %s", fn);
-            res = WALK_BADIO;
+        size_t nameLength = strlen(name);
+        if (length + nameLength >= FILENAME_MAX) {
+            warnx("%s%s: name too long", path, name);
+            res = WALK_NAMETOOLONG;
             continue;
         }
+        memcpy(path + length, name, nameLength + 1);
+
+        int type = dent->d_type;
+        dev_t entryDev = dev;
+        ino_t entryIno = dent->d_ino;
+        if (type == DT_UNKNOWN || (type == DT_LNK && (W->spec & WS_FOLLOWLINK))) {
+            if (fstatat(dirfd(dir), name, &st, (W->spec & WS_FOLLOWLINK) ? 0 : AT_SYMLINK_NOFOLLOW) == -1) {
+                // a dangling symlink is left alone like any other symlink
+                if (type == DT_LNK && errno == ENOENT) continue;
+                warn("can't stat %s", path);
+                res = WALK_BADIO;
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+            entryDev = st.st_dev;
+            entryIno = st.st_ino;
+        }
 
         /* don't follow symlink unless told so */
-        if (S_ISLNK(st.st_mode) && !(spec & WS_FOLLOWLINK))
+        if (type == DT_LNK)
             continue;
 
-        /* will be false for symlinked dirs */
-        if (S_ISDIR(st.st_mode)) {
-            /* recursively follow dirs */
-            if ((spec & WS_RECURSIVE))
-                walk_recur(fn, reg, spec, Q);
-
-            if (!(spec & WS_MATCHDIRS)) continue;
+        if (type == DT_DIR) {
+            if (W->spec & WS_RECURSIVE)
+                walkPool_push(W, walker, path);
+            continue;
         }
 
-        /* pattern match */
-        if (!regexec(reg, fn, 0, 0, 0)) {
-//            puts(fn);
-            if (dname[0] == '.'){
-                //hidden file! skip.
-            }
-            else {
-                queue_add(Q, fn);
-                totalNumberOfFiles++;
-            }
-
+        if (hasSuffix(name, nameLength, W->suffix, W->suffixLength)) {
+            queue_addFile(W->files, path, entryDev, entryIno);
         }
     }
 
-    if (dir) closedir(dir);
-    return res ? res : errno ? WALK_BADIO : WALK_OK;
-}
-
-int walk_dir(char *dname, char *pattern, int spec, struct queue *Q) {
-    regex_t r;
-    int res;
-    if (regcomp(&r, pattern, REG_EXTENDED | REG_NOSUB))
-        return WALK_BADPATTERN;
-    res = walk_recur(dname, &r, spec, Q);
-    regfree(&r);
-
-    return res;
-}
-
-int traverseMain(struct queue *Q, char * currElement) {
-    int r = walk_dir(currElement, ".\\.txt$", WS_DEFAULT|WS_MATCHDIRS, Q);
-    switch(r) {
-        case WALK_OK:		break;
-        case WALK_BADIO:	err(1, "IO error");
-        case WALK_BADPATTERN:	err(1, "Bad pattern");
-        case WALK_NAMETOOLONG:	err(1, "Filename too long");
-        default:
-            err(1, "Unknown error?");
+    if (errno != 0) {
+        warn("can't read %s", dirName);
+        res = WALK_BADIO;
     }
-    return EXIT_SUCCESS;
+    closedir(dir);
+    return res;
 }
 
 int countNumberOfTextFiles(int argc, char* argv[]) {
@@ -227,34 +791,295 @@ int countNumberOfTextFiles(int argc, char* argv[]) {
 }
 
 // takes in a dir/file arguement from main, does the following:
-// checks if it is just a file or a directory, if file, just add to queue IF it doesnt already exist and return. if direcotry, continue
-// if directory, send into traverseMain. the traversal methods
-int fileManager(struct queue *Q, char * currElement) {
-    if (strlen(currElement) > 3 && currElement[strlen(currElement)-1] == 't' && currElement[strlen(currElement)-2] == 'x' && currElement[strlen(currElement)-3] == 't') {
+// checks if it is just a file or a directory, if file, just add to the file queue and return (duplicates are weeded out
+// by inode there). a file named on the command line is read whatever its suffix, and one that doesn't exist is left
+// for its reader to complain about. if directory, hand it to the walkers.
+int fileManager(struct queue *Q, struct walkPool *W, char * currElement) {
+    struct stat st;
+    if (stat(currElement, &st) == -1) {
+        queue_add(Q, currElement);
+    }
+    else if (S_ISDIR(st.st_mode)) {
+        walkPool_push(W, -1, currElement);
+    }
+    else {
         //this is a file!
-        int alreadyExist = alreadyExists(Q, currElement);
-        if (alreadyExist) {
-            //element already exists, so just skip it.
+        queue_addFile(Q, currElement, st.st_dev, st.st_ino);
+    }
+    return EXIT_SUCCESS;
+}
+
+// parses the option at argv[*i], moving *i past its value when the value is the next argument
+int parseOption(int argc, char **argv, int *i, struct options *opts) {
+    char *arg = argv[*i];
+    char *end;
+    if (!strcmp(arg, "--stream")) {
+        opts->stream = 1;
+        return EXIT_SUCCESS;
+    }
+    if (!strcmp(arg, "--stats")) {
+        opts->stats = 1;
+        return EXIT_SUCCESS;
+    }
+    if (!strcmp(arg, "--follow-links")) {
+        opts->followLinks = 1;
+        return EXIT_SUCCESS;
+    }
+    if (!strcmp(arg, "--top") || !strcmp(arg, "--max-jsd") || !strcmp(arg, "--lsh") || !strcmp(arg, "--cache")
+        || !strcmp(arg, "--index") || !strcmp(arg, "--archive") || !strcmp(arg, "--write-index")
+        || !strcmp(arg, "--stats-json")) {
+        if (*i + 1 >= argc) {
+            return EXIT_FAILURE;
+        }
+        char *value = argv[++*i];
+        errno = 0;
+        if (!strcmp(arg, "--top")) {
+            long long top = strtoll(value, &end, 10);
+            if (value[0] == '\0' || *end != '\0' || errno != 0 || top < 1) {
+                return EXIT_FAILURE;
+            }
+            opts->top = top;
+        }
+        else if (!strcmp(arg, "--cache") || !strcmp(arg, "--index") || !strcmp(arg, "--archive")
+                 || !strcmp(arg, "--write-index") || !strcmp(arg, "--stats-json")) {
+            if (value[0] == '\0') {
+                return EXIT_FAILURE;
+            }
+            if (!strcmp(arg, "--cache")) opts->cacheDirectory = value;
+            else if (!strcmp(arg, "--write-index")) opts->writeIndexFile = value;
+            else if (!strcmp(arg, "--stats-json")) opts->statsFile = value;
+            else {
+                // one index per run: a second --index or --archive would silently replace the first
+                if (opts->indexFile != NULL) {
+                    return EXIT_FAILURE;
+                }
+                opts->indexFile = value;
+                opts->archive = !strcmp(arg, "--archive");
+            }
+        }
+        else if (!strcmp(arg, "--lsh")) {
+            long bands = strtol(value, &end, 10);
+            if (value[0] == '\0' || *end != '\0' || errno != 0 || bands < 1 || bands > LSHMAXBANDS) {
+                return EXIT_FAILURE;
+            }
+            opts->lshBands = (int) bands;
         }
         else {
-            queue_add(Q, currElement);
-            totalNumberOfFiles++;
+            double maxJSD = strtod(value, &end);
+            if (value[0] == '\0' || *end != '\0' || errno != 0 || !(maxJSD >= 0.0)) {
+                return EXIT_FAILURE;
+            }
+            opts->maxJSD = maxJSD;
         }
         return EXIT_SUCCESS;
     }
-    else {
-        traverseMain(Q, currElement);
+
+    if (arg[1] == 's') {
+        // an empty suffix reads every file
+        opts->suffix = arg + 2;
+        return EXIT_SUCCESS;
+    }
+
+    int *target;
+    switch (arg[1]) {
+        case 'd':	target = &opts->directoryThreads; break;
+        case 'f':	target = &opts->fileThreads; break;
+        case 'a':	target = &opts->analysisThreads; break;
+        default:
+            return EXIT_FAILURE;
+    }
+
+    errno = 0;
+    long value = strtol(arg + 2, &end, 10);
+    if (arg[2] == '\0' || *end != '\0' || errno != 0 || value < 1 || value > 1024) {
+        return EXIT_FAILURE;
     }
+    *target = (int) value;
+    return EXIT_SUCCESS;
 }
 
 // ------------------------------- END OF FILE TRAVERSAL HELPERS -------------------------------
 
+// ------------------------------- PATH STORE -------------------------------
+
+void *arena_alloc(struct arena *A, size_t size) {
+    size = (size + 7) & ~(size_t) 7;
+    struct arenaChunk *chunk = A->chunks;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunkSize = size > ARENACHUNKSIZE ? size : ARENACHUNKSIZE;
+        chunk = malloc(sizeof(struct arenaChunk) + chunkSize);
+        if (chunk == NULL) {
+            err(1, "out of memory");
+        }
+        chunk->used = 0;
+        chunk->size = chunkSize;
+        chunk->next = A->chunks;
+        A->chunks = chunk;
+    }
+    void *memory = chunk->data + chunk->used;
+    chunk->used += size;
+    return memory;
+}
+
+char *arena_strdup(struct arena *A, const char *string) {
+    size_t len = strlen(string) + 1;
+    char *copy = arena_alloc(A, len);
+    memcpy(copy, string, len);
+    return copy;
+}
+
+void arena_destroy(struct arena *A) {
+    struct arenaChunk *chunk = A->chunks;
+    while (chunk != NULL) {
+        struct arenaChunk *tmp = chunk;
+        chunk = chunk->next;
+        free(tmp);
+    }
+    A->chunks = NULL;
+}
+
+int pathStore_init(struct pathStore *P) {
+    P->strings.chunks = NULL;
+    P->capacity = PATHTABLESIZE;
+    P->count = 0;
+    P->slots = calloc(P->capacity, sizeof(char *));
+    if (P->slots == NULL) {
+        err(1, "out of memory");
+    }
+    if (pthread_mutex_init(&P->lock, NULL) != 0) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// returns the stored copy of path, adding it first if it isn't there yet. *isNew says which happened.
+char *pathStore_intern(struct pathStore *P, const char *path, int *isNew) {
+    pthread_mutex_lock(&P->lock);
+
+    // keep the load factor under 3/4
+    if ((P->count + 1) * 4 > P->capacity * 3) {
+        size_t newCapacity = P->capacity * 2;
+        char **newSlots = calloc(newCapacity, sizeof(char *));
+        if (newSlots == NULL) {
+            err(1, "out of memory");
+        }
+        for (size_t i = 0; i < P->capacity; i++) {
+            if (P->slots[i] == NULL) continue;
+            size_t index = hashWord(P->slots[i]) & (newCapacity - 1);
+            while (newSlots[index] != NULL) {
+                index = (index + 1) & (newCapacity - 1);
+            }
+            newSlots[index] = P->slots[i];
+        }
+        free(P->slots);
+        P->slots = newSlots;
+        P->capacity = newCapacity;
+    }
+
+    size_t index = hashWord(path) & (P->capacity - 1);
+    while (P->slots[index] != NULL) {
+        if (strcmp(P->slots[index], path) == 0) {
+            pthread_mutex_unlock(&P->lock);
+            *isNew = 0;
+            return P->slots[index];
+        }
+        index = (index + 1) & (P->capacity - 1);
+    }
+
+    char *copy = arena_strdup(&P->strings, path);
+    P->slots[index] = copy;
+    P->count++;
+
+    pthread_mutex_unlock(&P->lock);
+    *isNew = 1;
+    return copy;
+}
+
+void pathStore_destroy(struct pathStore *P) {
+    arena_destroy(&P->strings);
+    free(P->slots);
+    P->slots = NULL;
+    pthread_mutex_destroy(&P->lock);
+}
+
+// ------------------------------- END OF PATH STORE -------------------------------
+
+// ------------------------------- INODE SET -------------------------------
+
+int inodeSet_init(struct inodeSet *S) {
+    S->capacity = INODESETSIZE;
+    S->count = 0;
+    S->slots = calloc(S->capacity, sizeof(struct inodeKey));
+    if (S->slots == NULL) {
+        err(1, "out of memory");
+    }
+    if (pthread_mutex_init(&S->lock, NULL) != 0) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static size_t inodeSlot(dev_t dev, ino_t ino, size_t capacity) {
+    return hashId((unsigned long long) dev * 0x9e3779b97f4a7c15ULL ^ (unsigned long long) ino) & (capacity - 1);
+}
+
+// adds (dev, ino), returns 1 if it wasn't there yet and 0 if it was
+int inodeSet_insert(struct inodeSet *S, dev_t dev, ino_t ino) {
+    pthread_mutex_lock(&S->lock);
+
+    // keep the load factor under 3/4
+    if ((S->count + 1) * 4 > S->capacity * 3) {
+        size_t newCapacity = S->capacity * 2;
+        struct inodeKey *newSlots = calloc(newCapacity, sizeof(struct inodeKey));
+        if (newSlots == NULL) {
+            err(1, "out of memory");
+        }
+        for (size_t i = 0; i < S->capacity; i++) {
+            if (S->slots[i].ino == 0) continue;
+            size_t index = inodeSlot(S->slots[i].dev, S->slots[i].ino, newCapacity);
+            while (newSlots[index].ino != 0) {
+                index = (index + 1) & (newCapacity - 1);
+            }
+            newSlots[index] = S->slots[i];
+        }
+        free(S->slots);
+        S->slots = newSlots;
+        S->capacity = newCapacity;
+    }
+
+    size_t index = inodeSlot(dev, ino, S->capacity);
+    while (S->slots[index].ino != 0) {
+        if (S->slots[index].dev == dev && S->slots[index].ino == ino) {
+            pthread_mutex_unlock(&S->lock);
+            return 0;
+        }
+        index = (index + 1) & (S->capacity - 1);
+    }
+    S->slots[index].dev = dev;
+    S->slots[index].ino = ino;
+    S->count++;
+
+    pthread_mutex_unlock(&S->lock);
+    return 1;
+}
+
+void inodeSet_destroy(struct inodeSet *S) {
+    free(S->slots);
+    S->slots = NULL;
+    pthread_mutex_destroy(&S->lock);
+}
+
+// ------------------------------- END OF INODE SET -------------------------------
+
 // ------------------------------- QUEUE STRUCTURE -------------------------------
 
-int queue_init(struct queue *Q)
+int queue_init(struct queue *Q, struct pathStore *paths)
 {
+    Q->paths = paths;
+    Q->inodes = NULL;
     Q->head = 0;
     Q->count = 0;
+    Q->closed = 0;
     int i = pthread_mutex_init(&Q->lock, NULL);
     int j = pthread_cond_init(&Q->read_ready, NULL);
     int k = pthread_cond_init(&Q->write_ready, NULL);
@@ -266,8 +1091,26 @@ int queue_init(struct queue *Q)
     return EXIT_SUCCESS;
 }
 
+// marks the queue as finished, readers drain what is left and then get EXIT_FAILURE from queue_remove
+void queue_close(struct queue *Q)
+{
+    pthread_mutex_lock(&Q->lock);
+    Q->closed = 1;
+    pthread_mutex_unlock(&Q->lock);
+    pthread_cond_broadcast(&Q->read_ready);
+}
+
+// interns item and adds it to the queue. a path that was already added (to any queue sharing the path store)
+// is skipped, which is how duplicate files and directories are weeded out.
 int queue_add(struct queue *Q, char * item)
 {
+    int isNew;
+    item = pathStore_intern(Q->paths, item, &isNew);
+    if (!isNew) {
+        //element already exists, so just skip it.
+        return EXIT_SUCCESS;
+    }
+
     pthread_mutex_lock(&Q->lock); // make sure no one else touches Q until we're done
 
     while (Q->count == QUEUESIZE) {
@@ -281,7 +1124,7 @@ int queue_add(struct queue *Q, char * item)
     unsigned index = Q->head + Q->count;
     if (index >= QUEUESIZE) index -= QUEUESIZE;
 
-    strcpy(Q->data[index], item);
+    Q->data[index] = item;
     ++Q->count;
 
     pthread_mutex_unlock(&Q->lock); // now we're done
@@ -290,17 +1133,34 @@ int queue_add(struct queue *Q, char * item)
     return 0;
 }
 
-int queue_remove(struct queue *Q, char *item)
+// adds a file known to be (dev, ino), unless that file was already added under any name: ./a/x.txt and a/x.txt,
+// a hard link, or a file named on the command line that a walker finds again
+int queue_addFile(struct queue *Q, char *item, dev_t dev, ino_t ino)
+{
+    if (Q->inodes != NULL && !inodeSet_insert(Q->inodes, dev, ino)) {
+        return EXIT_SUCCESS;
+    }
+    return queue_add(Q, item);
+}
+
+// points *item at the (interned) head of the queue.
+// returns EXIT_FAILURE once the queue is closed and empty.
+int queue_remove(struct queue *Q, char **item)
 {
     pthread_mutex_lock(&Q->lock);
 
-    while (Q->count == 0) {
+    while (Q->count == 0 && !Q->closed) {
         pthread_cond_wait(&Q->read_ready, &Q->lock);
     }
 
+    if (Q->count == 0) {
+        pthread_mutex_unlock(&Q->lock);
+        return EXIT_FAILURE;
+    }
+
     // now we have exclusive access and queue is non-empty
 
-    item = Q->data[Q->head];  // write value at head to pointer
+    *item = Q->data[Q->head];  // write value at head to pointer
     --Q->count;
     ++Q->head;
     if (Q->head == QUEUESIZE) Q->head = 0;
@@ -319,17 +1179,6 @@ void queuePrint(struct queue *Q) {
     }
 }
 
-int alreadyExists(struct queue *Q, char * currElement) {
-    int count = Q->count;
-    for (int i = 0; i < count; i++) {
-        if (strcmp(Q->data[i], currElement) == 0) {
-            // already exists, return 1
-            return 1;
-        }
-    }
-    return 0;
-}
-
 // ------------------------------- END OF QUEUE STRUCTURE -------------------------------
 
 // ------------------------------- WFD REPOSITORY QUEUE STRUCTURE -------------------------------
@@ -338,6 +1187,16 @@ int WFDqueueinit(struct WFDrepository *Q)
 {
     Q->head = 0;
     Q->count = 0;
+    Q->ready = 0;
+    Q->duplicates = 0;
+    Q->nextCopy = NULL;
+    Q->capacity = REPOSITORYSIZE;
+    Q->data = malloc(Q->capacity * sizeof(struct WFD));
+    Q->fileNames = malloc(Q->capacity * sizeof(char *));
+    Q->wordCounts = malloc(Q->capacity * sizeof(int));
+    if (Q->data == NULL || Q->fileNames == NULL || Q->wordCounts == NULL) {
+        err(1, "out of memory");
+    }
     int i = pthread_mutex_init(&Q->lock, NULL);
     int j = pthread_cond_init(&Q->read_ready, NULL);
     int k = pthread_cond_init(&Q->write_ready, NULL);
@@ -349,564 +1208,2043 @@ int WFDqueueinit(struct WFDrepository *Q)
     return EXIT_SUCCESS;
 }
 
-int WFDqueue_add(struct WFDrepository *Q, struct Node * item, char * fileName)
+// claims the next repository slot for fileName (interned, so it isn't copied) and returns its index.
+// paths are unique by the time they get here, the queues weed out duplicates.
+int WFDqueue_reserve(struct WFDrepository *Q, char * fileName)
 {
-    pthread_mutex_lock(&Q->lock); // make sure no one else touches Q until we're done
+    pthread_mutex_lock(&Q->lock);
 
-    while (Q->count == QUEUESIZE) {
-        // wait for another thread to dequeue
-        pthread_cond_wait(&Q->write_ready, &Q->lock);
-        // release lock & wait for a thread to signal write_ready
+    if (Q->count == Q->capacity) {
+        Q->capacity *= 2;
+        Q->data = realloc(Q->data, Q->capacity * sizeof(struct WFD));
+        Q->fileNames = realloc(Q->fileNames, Q->capacity * sizeof(char *));
+        Q->wordCounts = realloc(Q->wordCounts, Q->capacity * sizeof(int));
+        if (Q->data == NULL || Q->fileNames == NULL || Q->wordCounts == NULL) {
+            err(1, "out of memory");
+        }
     }
 
-    // at this point, we hold the lock & Q->count < QUEUESIZE
+    int index = Q->count;
+    Q->data[index].block = NULL;  // filled in by WFDqueue_set
+    Q->data[index].count = 0;
+    Q->fileNames[index] = fileName;
+    Q->wordCounts[index] = 0;
+    ++Q->count;
 
-    unsigned index = Q->head + Q->count;
-    if (index >= QUEUESIZE) index -= QUEUESIZE;
+    pthread_mutex_unlock(&Q->lock);
+    return index;
+}
 
-    Q->data[index] = item;
-    strcpy(Q->fileNames[index], fileName);
-    ++Q->count;
+// drops the slots of files that couldn't be read (word count -1), keeping the others in order.
+// only call once every reader is done.
+void WFDqueue_compact(struct WFDrepository *Q)
+{
+    unsigned kept = 0;
+    for (unsigned i = 0; i < Q->count; i++) {
+        if (Q->wordCounts[i] < 0) {
+            WFD_destroy(&Q->data[i]);
+            continue;
+        }
+        if (kept != i) {
+            Q->data[kept] = Q->data[i];
+            Q->wordCounts[kept] = Q->wordCounts[i];
+            Q->fileNames[kept] = Q->fileNames[i];
+        }
+        kept++;
+    }
+    Q->count = kept;
+    Q->ready = kept;
+}
 
-    pthread_mutex_unlock(&Q->lock); // now we're done
-    pthread_cond_signal(&Q->read_ready); // wake up a thread waiting to read (if any)
+int cmpFileName(const void *a, const void *b) {
+    return strcmp(**(char * const * const *) a, **(char * const * const *) b);
+}
 
-    return 0;
+// puts the slots from first on in path order. readers fill slots in whatever order the walkers and readers happen
+// to reach the files, and the slot order decides how each pair is printed and how ties are broken
+void WFDqueue_sort(struct WFDrepository *Q, unsigned first)
+{
+    if (Q->count < first + 2) {
+        return;
+    }
+    unsigned n = Q->count - first;
+    char ***order = malloc(n * sizeof(char **));
+    struct WFD *data = malloc(n * sizeof(struct WFD));
+    int *wordCounts = malloc(n * sizeof(int));
+    char **fileNames = malloc(n * sizeof(char *));
+    if (order == NULL || data == NULL || wordCounts == NULL || fileNames == NULL) {
+        err(1, "out of memory");
+    }
+    for (unsigned i = 0; i < n; i++) {
+        order[i] = &Q->fileNames[first + i];
+    }
+    qsort(order, n, sizeof(char **), cmpFileName);
+    for (unsigned i = 0; i < n; i++) {
+        unsigned from = (unsigned) (order[i] - Q->fileNames);
+        data[i] = Q->data[from];
+        wordCounts[i] = Q->wordCounts[from];
+        fileNames[i] = Q->fileNames[from];
+    }
+    memcpy(Q->data + first, data, n * sizeof(struct WFD));
+    memcpy(Q->wordCounts + first, wordCounts, n * sizeof(int));
+    memcpy(Q->fileNames + first, fileNames, n * sizeof(char *));
+    free(order);
+    free(data);
+    free(wordCounts);
+    free(fileNames);
 }
 
-int WFDqueue_remove(struct WFDrepository *Q, struct Node * item)
+// same words with the same counts, so JSD 0 with anything they are both compared to the same way
+int WFD_equal(struct WFD *A, struct WFD *B) {
+    return A->count == B->count
+           && memcmp(A->ids, B->ids, A->count * sizeof(unsigned)) == 0
+           && memcmp(A->wordCounts, B->wordCounts, A->count * sizeof(int)) == 0;
+}
+
+// groups files with identical contents (same content hash, same WFD) so only one file per group is compared with
+// the others: the first file of every group stays among the first count, in order, and the copies move after them
+// with their WFDs freed. nextCopy chains each group from its first file through its copies.
+// only call once every reader is done, returns the number of copies
+unsigned WFDqueue_group(struct WFDrepository *Q)
 {
-    destroyList(Q->data[Q->count]);
+    int n = Q->count;
+    size_t capacity = 16;
+    while (capacity < 2 * (size_t) n) capacity *= 2;
+    int *table = malloc(capacity * sizeof(int));  // first file of each group seen so far, by hash
+    int *first = malloc(n * sizeof(int));  // first file of the group of each file
+    if (table == NULL || first == NULL) {
+        err(1, "out of memory");
+    }
+    memset(table, -1, capacity * sizeof(int));
+
+    int groups = 0;
+    for (int i = 0; i < n; i++) {
+        first[i] = i;
+        unsigned long long hash = Q->data[i].contentHash;
+        if (hash != 0) {
+            size_t slot = hash & (capacity - 1);
+            // equal hashes are checked word by word, a collision only starts a group of its own
+            while (table[slot] != -1 && first[i] == i) {
+                int other = table[slot];
+                if (Q->data[other].contentHash == hash && Q->wordCounts[other] == Q->wordCounts[i]
+                    && WFD_equal(&Q->data[other], &Q->data[i])) {
+                    first[i] = other;
+                }
+                slot = (slot + 1) & (capacity - 1);
+            }
+            if (first[i] == i) {
+                table[slot] = i;
+            }
+        }
+        if (first[i] == i) groups++;
+    }
+    free(table);
 
+    unsigned copies = n - groups;
+    if (copies == 0) {
+        free(first);
+        return 0;
+    }
+
+    // first files keep their order at the front, copies follow in theirs
+    int *position = malloc(n * sizeof(int));
+    struct WFD *data = malloc(Q->capacity * sizeof(struct WFD));
+    char **fileNames = malloc(Q->capacity * sizeof(char *));
+    int *wordCounts = malloc(Q->capacity * sizeof(int));
+    int *nextCopy = malloc(n * sizeof(int));
+    int *last = malloc(n * sizeof(int));  // end of each group's chain so far
+    if (position == NULL || data == NULL || fileNames == NULL || wordCounts == NULL || nextCopy == NULL
+        || last == NULL) {
+        err(1, "out of memory");
+    }
+    int front = 0, back = groups;
+    for (int i = 0; i < n; i++) {
+        position[i] = first[i] == i ? front++ : back++;
+        int p = position[i];
+        data[p] = Q->data[i];
+        fileNames[p] = Q->fileNames[i];
+        wordCounts[p] = Q->wordCounts[i];
+        nextCopy[p] = -1;
+        if (first[i] == i) {
+            last[p] = p;
+        }
+        else {
+            WFD_destroy(&data[p]);
+            int group = position[first[i]];
+            nextCopy[last[group]] = p;
+            last[group] = p;
+        }
+    }
+    free(Q->data);
+    free(Q->fileNames);
+    free(Q->wordCounts);
+    Q->data = data;
+    Q->fileNames = fileNames;
+    Q->wordCounts = wordCounts;
+    Q->nextCopy = nextCopy;
+    Q->count = groups;
+    Q->ready = groups;
+    Q->duplicates = copies;
+    free(position);
+    free(last);
+    free(first);
+    return copies;
+}
+
+// stores the finished WFD and its file's word count for a slot handed out by WFDqueue_reserve
+void WFDqueue_set(struct WFDrepository *Q, int index, struct WFD * item, int wordCount)
+{
     pthread_mutex_lock(&Q->lock);
+    Q->data[index] = *item;
+    Q->wordCounts[index] = wordCount;
+    ++Q->ready;
+    pthread_mutex_unlock(&Q->lock);
+    pthread_cond_broadcast(&Q->read_ready);
+}
 
-    while (Q->count == 0) {
-        pthread_cond_wait(&Q->read_ready, &Q->lock);
+// appends a finished WFD in one go, fileName must outlive the repository
+int WFDqueue_add(struct WFDrepository *Q, struct WFD * item, char * fileName)
+{
+    int index = WFDqueue_reserve(Q, fileName);
+    WFDqueue_set(Q, index, item, 0);
+    return 0;
+}
+
+void WFDqueue_print(struct WFDrepository *Q) {
+    int count = Q->count;
+    for (int i = 0; i < count; i++) {
+        printf("LOOKING AT FILE: %s\n", Q->fileNames[i]);
+        printWFD(&Q->data[i]);
+        printf("\n");
+    }
+}
+
+void WFDqueue_destroy(struct WFDrepository *Q) {
+    for (unsigned i = 0; i < Q->count; i++) {
+        WFD_destroy(&Q->data[i]);
+    }
+    free(Q->data);
+    free(Q->fileNames);
+    free(Q->wordCounts);
+    free(Q->nextCopy);
+    pthread_mutex_destroy(&Q->lock);
+    pthread_cond_destroy(&Q->read_ready);
+    pthread_cond_destroy(&Q->write_ready);
+}
+
+// ------------------------------- END OF WFD REPOSITORY QUEUE STRUCTURE -------------------------------
+
+// ------------------------------- VOCABULARY -------------------------------
+
+int vocabulary_init(struct vocabulary *V) {
+    V->strings.chunks = NULL;
+    V->count = 0;
+    V->capacity = VOCABULARYSIZE;
+    V->words = malloc(V->capacity * sizeof(char *));
+    V->tableCapacity = VOCABULARYSIZE * 2;
+    V->slots = calloc(V->tableCapacity, sizeof(unsigned));
+    if (V->words == NULL || V->slots == NULL) {
+        err(1, "out of memory");
+    }
+    if (pthread_mutex_init(&V->lock, NULL) != 0) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// returns the id of word, giving it the next free id the first time it is seen.
+// call with V->lock held, so a whole file's words can be interned under one lock.
+unsigned vocabulary_intern(struct vocabulary *V, const char *word) {
+    // keep the load factor under 1/2
+    if ((V->count + 1) * 2 > V->tableCapacity) {
+        size_t newCapacity = V->tableCapacity * 2;
+        unsigned *newSlots = calloc(newCapacity, sizeof(unsigned));
+        if (newSlots == NULL) {
+            err(1, "out of memory");
+        }
+        for (unsigned id = 0; id < V->count; id++) {
+            size_t index = hashWord(V->words[id]) & (newCapacity - 1);
+            while (newSlots[index] != 0) {
+                index = (index + 1) & (newCapacity - 1);
+            }
+            newSlots[index] = id + 1;
+        }
+        free(V->slots);
+        V->slots = newSlots;
+        V->tableCapacity = newCapacity;
+    }
+
+    size_t index = hashWord(word) & (V->tableCapacity - 1);
+    while (V->slots[index] != 0) {
+        unsigned id = V->slots[index] - 1;
+        if (strcmp(V->words[id], word) == 0) {
+            return id;
+        }
+        index = (index + 1) & (V->tableCapacity - 1);
+    }
+
+    if (V->count == V->capacity) {
+        V->capacity *= 2;
+        V->words = realloc(V->words, V->capacity * sizeof(char *));
+        if (V->words == NULL) {
+            err(1, "out of memory");
+        }
+    }
+    unsigned id = V->count++;
+    V->words[id] = arena_strdup(&V->strings, word);
+    V->slots[index] = id + 1;
+    return id;
+}
+
+char *vocabulary_word(struct vocabulary *V, unsigned id) {
+    pthread_mutex_lock(&V->lock);
+    char *word = V->words[id];
+    pthread_mutex_unlock(&V->lock);
+    return word;
+}
+
+void vocabulary_destroy(struct vocabulary *V) {
+    arena_destroy(&V->strings);
+    free(V->words);
+    free(V->slots);
+    V->words = NULL;
+    V->slots = NULL;
+    pthread_mutex_destroy(&V->lock);
+}
+
+// ------------------------------- END OF VOCABULARY -------------------------------
+
+// ------------------------------- WFD HASH TABLE -------------------------------
+
+// open addressing (linear probing) table counting the words of one file. it is private to the reader
+// building the WFD, so no locking is needed until its distinct words are handed to the vocabulary.
+
+unsigned long hashWord(const char *word) {
+    // FNV-1a
+    unsigned long hash = 14695981039346656037UL;
+    while (*word) {
+        hash ^= (unsigned char) *word++;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+int WFDtable_init(struct WFDtable *T) {
+    T->capacity = WFDTABLESIZE;
+    T->count = 0;
+    T->words.chunks = NULL;
+    T->slots = calloc(T->capacity, sizeof(struct WFDslot));
+    if (T->slots == NULL) {
+        err(1, "out of memory");
+    }
+    return EXIT_SUCCESS;
+}
+
+void WFDtable_destroy(struct WFDtable *T) {
+    arena_destroy(&T->words);
+    free(T->slots);
+    T->slots = NULL;
+    T->capacity = 0;
+    T->count = 0;
+}
+
+static void WFDtable_grow(struct WFDtable *T) {
+    size_t newCapacity = T->capacity * 2;
+    struct WFDslot *newSlots = calloc(newCapacity, sizeof(struct WFDslot));
+    if (newSlots == NULL) {
+        err(1, "out of memory");
+    }
+    for (size_t i = 0; i < T->capacity; i++) {
+        if (T->slots[i].word == NULL) continue;
+        size_t index = hashWord(T->slots[i].word) & (newCapacity - 1);
+        while (newSlots[index].word != NULL) {
+            index = (index + 1) & (newCapacity - 1);
+        }
+        newSlots[index] = T->slots[i];
+    }
+    free(T->slots);
+    T->slots = newSlots;
+    T->capacity = newCapacity;
+}
+
+// bumps the count of new_data, adding it the first time it is seen
+void WFDtable_insert(struct WFDtable *T, char *new_data) {
+    WFDtable_add(T, new_data, 1);
+}
+
+// adds count to the count of new_data
+void WFDtable_add(struct WFDtable *T, char *new_data, long long count) {
+    // keep the load factor under 3/4
+    if ((T->count + 1) * 4 > T->capacity * 3) {
+        WFDtable_grow(T);
+    }
+
+    size_t index = hashWord(new_data) & (T->capacity - 1);
+    while (T->slots[index].word != NULL) {
+        if (strcmp(T->slots[index].word, new_data) == 0) {
+            T->slots[index].wordCount += count;
+            return;
+        }
+        index = (index + 1) & (T->capacity - 1);
+    }
+
+    T->slots[index].word = arena_strdup(&T->words, new_data);
+    T->slots[index].wordCount = count;
+    T->count++;
+}
+
+// ------------------------------- END OF WFD HASH TABLE -------------------------------
+
+// ------------------------------- WORD FREQUENCY ALGORITHM -------------------------------
+
+// feeds len bytes of a file through the tokenizer. words are runs of letters, digits and '-', lowercased, with
+// apostrophes dropped. a word is only emitted once the next one starts (or at the end of the file), so words can
+// span the blocks the file is read in.
+void tokenizer_feed(struct tokenizer *T, const char *buffer, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char ch = buffer[i];
+        if (isalnum(ch) || ch == '-') {
+            if (T->ENDWORDFLAG) { //new word
+                T->word[T->endOfWordIndex] = '\0';
+                if (T->emit) T->emit(T->ctx, T->word);
+                T->totalNumberOfWords++;
+                T->endOfWordIndex = 0;
+                T->ENDWORDFLAG = 0;
+            }
+            //adding to a word, anything past WORDSIZE is truncated
+            if (T->endOfWordIndex < WORDSIZE - 1) {
+                T->word[T->endOfWordIndex++] = tolower(ch);
+            }
+        }
+        else if (ch == '\''){
+            continue;
+        }
+        else {
+            T->ENDWORDFLAG = 1;
+        }
+    }
+}
+
+// emits the last word of the file and returns the total number of words
+int tokenizer_finish(struct tokenizer *T) {
+    T->word[T->endOfWordIndex] = '\0';
+    if (T->emit) T->emit(T->ctx, T->word);
+    T->totalNumberOfWords++;
+    return T->totalNumberOfWords;
+}
+
+// hands the whole file to consume front to back: in one piece when it can be memory mapped, in READBLOCKSIZE
+// blocks otherwise. returns -1 if the file can't be read
+int readFile(char *fileName, void (*consume)(void *ctx, const char *data, size_t len), void *ctx) {
+    int fd = open(fileName, O_RDONLY);
+    if (fd == -1) {
+        warn("can't open %s", fileName);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        warn("can't stat %s", fileName);
+        close(fd);
+        return -1;
+    }
+
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            consume(ctx, map, st.st_size);
+            __atomic_add_fetch(&stats.bytesRead, st.st_size, __ATOMIC_RELAXED);
+            munmap(map, st.st_size);
+            close(fd);
+            return 0;
+        }
+    }
+
+    char *buffer = malloc(READBLOCKSIZE);
+    if (buffer == NULL) {
+        err(1, "out of memory");
+    }
+    ssize_t readBytes;
+    while ((readBytes = read(fd, buffer, READBLOCKSIZE)) > 0) {
+        consume(ctx, buffer, readBytes);
+        __atomic_add_fetch(&stats.bytesRead, readBytes, __ATOMIC_RELAXED);
+    }
+    free(buffer);
+    close(fd);
+    if (readBytes == -1) {
+        warn("can't read %s", fileName);
+        return -1;
+    }
+    return 0;
+}
+
+// puts the whole of fileName in memory, mapping it when it can and reading it into a buffer otherwise.
+// returns -1 if the file can't be read
+int loadFile(char *fileName, struct fileContents *F) {
+    F->data = NULL;
+    F->length = 0;
+    F->mapped = 0;
+    int fd = open(fileName, O_RDONLY);
+    if (fd == -1) {
+        warn("can't open %s", fileName);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        warn("can't stat %s", fileName);
+        close(fd);
+        return -1;
+    }
+
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            F->data = map;
+            F->length = st.st_size;
+            F->mapped = 1;
+            __atomic_add_fetch(&stats.bytesRead, st.st_size, __ATOMIC_RELAXED);
+            close(fd);
+            return 0;
+        }
+    }
+
+    size_t capacity = 0;
+    ssize_t readBytes;
+    do {
+        if (F->length + READBLOCKSIZE > capacity) {
+            capacity = capacity == 0 ? READBLOCKSIZE : capacity * 2;
+            F->data = realloc(F->data, capacity);
+            if (F->data == NULL) {
+                err(1, "out of memory");
+            }
+        }
+        readBytes = read(fd, F->data + F->length, READBLOCKSIZE);
+        if (readBytes > 0) {
+            F->length += readBytes;
+            __atomic_add_fetch(&stats.bytesRead, readBytes, __ATOMIC_RELAXED);
+        }
+    } while (readBytes > 0);
+    close(fd);
+    if (readBytes == -1) {
+        warn("can't read %s", fileName);
+        unloadFile(F);
+        return -1;
+    }
+    return 0;
+}
+
+void unloadFile(struct fileContents *F) {
+    if (F->mapped) {
+        munmap(F->data, F->length);
+    }
+    else {
+        free(F->data);
+    }
+    F->data = NULL;
+    F->length = 0;
+    F->mapped = 0;
+}
+
+// the tokenizer and, when wanted, the content hash fed from the same blocks
+struct tokenizerPass {
+    struct tokenizer T;
+    struct contentHash H;
+    int hashing;
+};
+
+static void consumeTokens(void *ctx, const char *data, size_t len) {
+    struct tokenizerPass *pass = ctx;
+    tokenizer_feed(&pass->T, data, len);
+    if (pass->hashing) {
+        contentHash_feed(&pass->H, data, len);
+    }
+}
+
+// runs the whole file through the tokenizer in one pass, calling emit (if not NULL) once per word. when hash isn't
+// NULL the contents are hashed in the same pass (see contentHash_feed).
+// returns the total number of words, or -1 if the file can't be read.
+static void tokenizerPass_init(struct tokenizerPass *pass, void (*emit)(void *ctx, char *word), void *ctx, int hashing) {
+    pass->T.endOfWordIndex = 0;
+    pass->T.ENDWORDFLAG = 0;
+    pass->T.totalNumberOfWords = 0;
+    pass->T.emit = emit;
+    pass->T.ctx = ctx;
+    pass->hashing = hashing;
+    contentHash_init(&pass->H);
+}
+
+int tokenizeFile(char *fileName, void (*emit)(void *ctx, char *word), void *ctx, unsigned long long *hash) {
+    struct tokenizerPass pass;
+    tokenizerPass_init(&pass, emit, ctx, hash != NULL);
+
+    if (readFile(fileName, consumeTokens, &pass) == -1) {
+        return -1;
+    }
+    if (hash != NULL) {
+        *hash = contentHash_finish(&pass.H);
+    }
+    return tokenizer_finish(&pass.T);
+}
+
+static void emitToTable(void *ctx, char *word) {
+    WFDtable_insert(ctx, word);
+}
+
+// builds the WFD of fileName in a single pass over the file: words are counted in a private table, then each
+// distinct word is given its vocabulary id and the arrays are sorted by id.
+// returns the total number of words in the file, or -1 if it can't be read.
+int findWords(char *fileName, struct WFD *wfd) {
+    struct WFDtable table;
+    WFDtable_init(&table);
+
+    int totalNumberOfWords;
+    unsigned long long hash;
+    if (WFDcacheDirectory != NULL) {
+        totalNumberOfWords = WFDcache_tokenize(fileName, &table, &hash);
+    }
+    else {
+        totalNumberOfWords = tokenizeFile(fileName, emitToTable, &table, &hash);
+    }
+    if (totalNumberOfWords < 0) {
+        WFDtable_destroy(&table);
+        WFD_alloc(wfd, 0);
+        return -1;
+    }
+
+    // pack (id, count) into one integer so sorting by id is a plain integer sort
+    unsigned long long *packed = malloc(table.count * sizeof(unsigned long long) + 1);
+    if (packed == NULL) {
+        err(1, "out of memory");
+    }
+    int k = 0;
+    pthread_mutex_lock(&vocab.lock);
+    for (size_t i = 0; i < table.capacity; i++) {
+        if (table.slots[i].word == NULL) continue;
+        unsigned id = vocabulary_intern(&vocab, table.slots[i].word);
+        packed[k++] = ((unsigned long long) id << 32) | (unsigned) table.slots[i].wordCount;
+    }
+    pthread_mutex_unlock(&vocab.lock);
+    WFDtable_destroy(&table);
+
+    qsort(packed, k, sizeof(unsigned long long), cmpPacked);
+
+    // counts are final now, so every frequency is computed exactly once
+    WFD_alloc(wfd, k);
+    wfd->contentHash = hash;
+    for (int i = 0; i < k; i++) {
+        wfd->ids[i] = (unsigned) (packed[i] >> 32);
+        wfd->wordCounts[i] = (int) (packed[i] & 0xffffffffu);
+        wfd->frequencies[i] = (double) wfd->wordCounts[i] / (double) totalNumberOfWords;
+        wfd->selfTerms[i] = wfd->frequencies[i] * log2(wfd->frequencies[i]);
+        wfd->total += wfd->frequencies[i];
+    }
+    free(packed);
+    return totalNumberOfWords;
+}
+
+int findNumberOfWords(char * fileName) {
+    return tokenizeFile(fileName, NULL, NULL, NULL);
+}
+
+// builds the WFD of fileName, returning the file's total number of words (-1 if it can't be read)
+int WFDmain(char* fileName, struct WFD *wfd) {
+    // steps to WFD classify:
+    //  1) obtain text from file.
+    //  2) iterate through text character by character, make all lowercase. if space, set spaceFlag.
+    //  3) so long as spaceFlag is not set, concat each read character into a word.
+    //  4) count every word, then hand each distinct word to the vocabulary for its id
+    return findWords(fileName, wfd);
+}
+
+int cmpPacked(const void *a, const void *b) {
+    unsigned long long left = *(const unsigned long long *) a;
+    unsigned long long right = *(const unsigned long long *) b;
+    return (left > right) - (left < right);
+}
+
+// rounds a size in bytes up to whole cache lines
+static size_t WFD_lineRound(size_t bytes) {
+    return (bytes + WFDALIGNMENT - 1) & ~(size_t) (WFDALIGNMENT - 1);
+}
+
+// allocates the arrays of a WFD with room for count distinct words
+void WFD_alloc(struct WFD *wfd, int count) {
+    size_t frequencyBytes = WFD_lineRound(count * sizeof(double));
+    size_t idBytes = WFD_lineRound(count * sizeof(unsigned));
+    size_t countBytes = WFD_lineRound(count * sizeof(int));
+    void *block;
+    if (posix_memalign(&block, WFDALIGNMENT, 2 * frequencyBytes + idBytes + countBytes + WFDALIGNMENT) != 0) {
+        err(1, "out of memory");
+    }
+    wfd->block = block;
+    wfd->frequencies = block;
+    wfd->selfTerms = (double *) ((char *) block + frequencyBytes);
+    wfd->ids = (unsigned *) ((char *) block + 2 * frequencyBytes);
+    wfd->wordCounts = (int *) ((char *) block + 2 * frequencyBytes + idBytes);
+    wfd->count = count;
+    wfd->total = 0.0;
+    wfd->contentHash = 0;
+}
+
+void printWFD(struct WFD *wfd) {
+    for (int i = 0; i < wfd->count; i++) {
+        printf("WORD: %s\t\tWORD COUNT: %d\tFREQUENCY: %f\n", vocabulary_word(&vocab, wfd->ids[i]),
+               wfd->wordCounts[i], wfd->frequencies[i]);
+    }
+}
+
+void WFD_destroy(struct WFD *wfd) {
+    // all the arrays live in the same block
+    free(wfd->block);
+    wfd->block = NULL;
+    wfd->frequencies = NULL;
+    wfd->selfTerms = NULL;
+    wfd->ids = NULL;
+    wfd->wordCounts = NULL;
+    wfd->count = 0;
+}
+
+// ------------------------------- END OF WORD FREQUENCY ALGORITHM -------------------------------
+
+// ------------------------------- WFD CACHE -------------------------------
+
+void contentHash_init(struct contentHash *H) {
+    H->state = 0x243f6a8885a308d3ULL;
+    H->length = 0;
+    H->tailLength = 0;
+}
+
+static void contentHash_word(struct contentHash *H, unsigned long long word) {
+    word *= 0x87c37b91114253d5ULL;
+    word = (word << 31) | (word >> 33);
+    H->state ^= word * 0x4cf5ad432745937fULL;
+    H->state = ((H->state << 27) | (H->state >> 37)) * 5 + 0x52dce729;
+}
+
+void contentHash_feed(struct contentHash *H, const char *data, size_t len) {
+    H->length += len;
+    // finish the word the last block left off in
+    while (H->tailLength > 0 && H->tailLength < 8 && len > 0) {
+        H->tail[H->tailLength++] = *data++;
+        len--;
+    }
+    if (H->tailLength == 8) {
+        unsigned long long word;
+        memcpy(&word, H->tail, 8);
+        contentHash_word(H, word);
+        H->tailLength = 0;
+    }
+    for (; len >= 8; data += 8, len -= 8) {
+        unsigned long long word;
+        memcpy(&word, data, 8);
+        contentHash_word(H, word);
+    }
+    memcpy(H->tail + H->tailLength, data, len);
+    H->tailLength += len;
+}
+
+unsigned long long contentHash_finish(struct contentHash *H) {
+    unsigned long long word = 0;
+    memcpy(&word, H->tail, H->tailLength);
+    contentHash_word(H, word ^ ((unsigned long long) H->tailLength << 56));
+    return hashId(H->state ^ H->length);
+}
+
+static void WFDcache_path(char *path, size_t size, unsigned long long hash) {
+    snprintf(path, size, "%s/%016llx.wfd", WFDcacheDirectory, hash);
+}
+
+// fills table with the words cached for the given contents. returns the total number of words, or -1 when there
+// is no usable entry (the table is left empty then)
+int WFDcache_load(unsigned long long hash, unsigned long long length, struct WFDtable *table) {
+    char path[FILENAME_MAX];
+    WFDcache_path(path, sizeof(path), hash);
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        return -1;
+    }
+
+    struct WFDcacheHeader header;
+    int ok = fread(&header, sizeof(header), 1, in) == 1
+             && memcmp(header.magic, WFDCACHE_MAGIC, 8) == 0
+             && header.version == TOKENIZERVERSION
+             && header.contentHash == hash
+             && header.contentLength == length
+             && header.totalWords >= 0 && header.totalWords <= INT_MAX;
+    char word[WORDSIZE];
+    long long sum = 0;
+    for (unsigned i = 0; ok && i < header.words; i++) {
+        unsigned char wordLength;
+        int count;
+        ok = fread(&wordLength, 1, 1, in) == 1 && wordLength < WORDSIZE
+             && fread(word, 1, wordLength, in) == wordLength
+             && fread(&count, sizeof(count), 1, in) == 1
+             && count > 0;
+        if (ok) {
+            word[wordLength] = '\0';
+            WFDtable_add(table, word, count);
+            sum += count;
+        }
+    }
+    // the counts have to add up to the total, and nothing may follow the last word
+    ok = ok && sum == header.totalWords && fgetc(in) == EOF;
+    fclose(in);
+
+    if (!ok) {
+        // a broken entry is just a miss, it gets rewritten
+        WFDtable_destroy(table);
+        WFDtable_init(table);
+        return -1;
+    }
+    return (int) header.totalWords;
+}
+
+// writes the words of table to the cache. the entry is written under a temporary name and renamed into place, so
+// readers (this run's other threads or another run) never see half of one
+void WFDcache_store(unsigned long long hash, unsigned long long length, struct WFDtable *table, int totalNumberOfWords) {
+    char path[FILENAME_MAX], temporary[FILENAME_MAX];
+    WFDcache_path(path, sizeof(path), hash);
+    snprintf(temporary, sizeof(temporary), "%s/.%016llx.XXXXXX", WFDcacheDirectory, hash);
+    int fd = mkstemp(temporary);
+    if (fd == -1) {
+        warn("can't write to cache %s", WFDcacheDirectory);
+        return;
+    }
+    FILE *out = fdopen(fd, "wb");
+    if (out == NULL) {
+        warn("can't write to cache %s", WFDcacheDirectory);
+        close(fd);
+        unlink(temporary);
+        return;
+    }
+
+    struct WFDcacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, WFDCACHE_MAGIC, 8);
+    header.version = TOKENIZERVERSION;
+    header.words = (unsigned) table->count;
+    header.contentHash = hash;
+    header.contentLength = length;
+    header.totalWords = totalNumberOfWords;
+    int ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    for (size_t i = 0; ok && i < table->capacity; i++) {
+        if (table->slots[i].word == NULL) continue;
+        unsigned char wordLength = (unsigned char) strlen(table->slots[i].word);
+        int count = (int) table->slots[i].wordCount;
+        ok = fwrite(&wordLength, 1, 1, out) == 1
+             && fwrite(table->slots[i].word, 1, wordLength, out) == wordLength
+             && fwrite(&count, sizeof(count), 1, out) == 1;
+    }
+    if (fclose(out) != 0 || !ok || rename(temporary, path) == -1) {
+        warn("can't write to cache %s", WFDcacheDirectory);
+        unlink(temporary);
+    }
+}
+
+// counts the words of fileName into table, from the cache when its contents were seen before (by any earlier run
+// with the same tokenizer), tokenizing it and caching the result otherwise.
+// the file is read once: its contents are hashed in memory and, on a miss, tokenized from the same buffer.
+// returns the total number of words, or -1 if the file can't be read. *hash gets the hash of the contents
+int WFDcache_tokenize(char *fileName, struct WFDtable *table, unsigned long long *hash) {
+    struct fileContents F;
+    if (loadFile(fileName, &F) == -1) {
+        return -1;
+    }
+    struct tokenizerPass pass;
+    tokenizerPass_init(&pass, emitToTable, table, 1);
+    if (F.length > 0) {
+        contentHash_feed(&pass.H, F.data, F.length);
+    }
+    *hash = contentHash_finish(&pass.H);
+
+    int totalNumberOfWords = WFDcache_load(*hash, F.length, table);
+    if (totalNumberOfWords < 0) {
+        if (F.length > 0) {
+            tokenizer_feed(&pass.T, F.data, F.length);
+        }
+        totalNumberOfWords = tokenizer_finish(&pass.T);
+        WFDcache_store(*hash, F.length, table, totalNumberOfWords);
+    }
+    unloadFile(&F);
+    return totalNumberOfWords;
+}
+
+// ------------------------------- END OF WFD CACHE -------------------------------
+
+// ------------------------------- WFD INDEX -------------------------------
+
+static long long WFDindex_align(long long position) {
+    return (position + WFDALIGNMENT - 1) & ~(long long) (WFDALIGNMENT - 1);
+}
+
+// pads the file out to position, where the next section starts
+static int WFDindex_seek(FILE *out, long long position) {
+    while (ftell(out) < position) {
+        if (fputc(0, out) == EOF) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// writes every document of the repository to an index at path (through a temporary file renamed into place).
+// returns -1 if it can't be written
+int WFDindex_write(char *path, struct WFDrepository *repo) {
+    long long n = repo->count;
+    long long vocabularySize = vocab.count;
+    long long nonZeros = 0, wordBytes = 0, nameBytes = 0;
+    for (long long i = 0; i < n; i++) {
+        nonZeros += repo->data[i].count;
+        nameBytes += strlen(repo->fileNames[i]) + 1;
+    }
+    for (long long id = 0; id < vocabularySize; id++) {
+        wordBytes += strlen(vocabulary_word(&vocab, id)) + 1;
+    }
+
+    struct WFDindexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, WFDINDEX_MAGIC, 8);
+    header.version = WFDINDEXVERSION;
+    header.tokenizerVersion = TOKENIZERVERSION;
+    header.documents = n;
+    header.vocabularySize = vocabularySize;
+    header.nonZeros = nonZeros;
+    header.wordOffsets = WFDindex_align(sizeof(header));
+    header.wordStrings = WFDindex_align(header.wordOffsets + (vocabularySize + 1) * sizeof(long long));
+    header.nameOffsets = WFDindex_align(header.wordStrings + wordBytes);
+    header.names = WFDindex_align(header.nameOffsets + (n + 1) * sizeof(long long));
+    header.rows = WFDindex_align(header.names + nameBytes);
+    header.totalWords = WFDindex_align(header.rows + (n + 1) * sizeof(long long));
+    header.totals = WFDindex_align(header.totalWords + n * sizeof(int));
+    header.frequencies = WFDindex_align(header.totals + n * sizeof(double));
+    header.selfTerms = WFDindex_align(header.frequencies + nonZeros * sizeof(double));
+    header.ids = WFDindex_align(header.selfTerms + nonZeros * sizeof(double));
+    header.counts = WFDindex_align(header.ids + nonZeros * sizeof(unsigned));
+    header.size = header.counts + nonZeros * sizeof(int);
+
+    char temporary[FILENAME_MAX];
+    snprintf(temporary, sizeof(temporary), "%s.XXXXXX", path);
+    int fd = mkstemp(temporary);
+    // readable by whoever else shares the index, as a plain new file would be
+    mode_t mask = umask(0);
+    umask(mask);
+    if (fd != -1) fchmod(fd, 0666 & ~mask);
+    FILE *out = fd == -1 ? NULL : fdopen(fd, "wb");
+    if (out == NULL) {
+        warn("can't write %s", path);
+        if (fd != -1) {
+            close(fd);
+            unlink(temporary);
+        }
+        return -1;
+    }
+
+    int ok = fwrite(&header, sizeof(header), 1, out) == 1;
+
+    long long position = 0;
+    ok = ok && WFDindex_seek(out, header.wordOffsets) == 0;
+    for (long long id = 0; ok && id <= vocabularySize; id++) {
+        ok = fwrite(&position, sizeof(position), 1, out) == 1;
+        if (id < vocabularySize) position += strlen(vocabulary_word(&vocab, id)) + 1;
+    }
+    ok = ok && WFDindex_seek(out, header.wordStrings) == 0;
+    for (long long id = 0; ok && id < vocabularySize; id++) {
+        char *word = vocabulary_word(&vocab, id);
+        ok = fwrite(word, 1, strlen(word) + 1, out) == strlen(word) + 1;
+    }
+
+    position = 0;
+    ok = ok && WFDindex_seek(out, header.nameOffsets) == 0;
+    for (long long i = 0; ok && i <= n; i++) {
+        ok = fwrite(&position, sizeof(position), 1, out) == 1;
+        if (i < n) position += strlen(repo->fileNames[i]) + 1;
+    }
+    ok = ok && WFDindex_seek(out, header.names) == 0;
+    for (long long i = 0; ok && i < n; i++) {
+        ok = fwrite(repo->fileNames[i], 1, strlen(repo->fileNames[i]) + 1, out) == strlen(repo->fileNames[i]) + 1;
+    }
+
+    position = 0;
+    ok = ok && WFDindex_seek(out, header.rows) == 0;
+    for (long long i = 0; ok && i <= n; i++) {
+        ok = fwrite(&position, sizeof(position), 1, out) == 1;
+        if (i < n) position += repo->data[i].count;
+    }
+    ok = ok && WFDindex_seek(out, header.totalWords) == 0;
+    ok = ok && fwrite(repo->wordCounts, sizeof(int), n, out) == (size_t) n;
+    ok = ok && WFDindex_seek(out, header.totals) == 0;
+    for (long long i = 0; ok && i < n; i++) {
+        ok = fwrite(&repo->data[i].total, sizeof(double), 1, out) == 1;
+    }
+
+    // the arrays of every document back to back, one section per array
+    ok = ok && WFDindex_seek(out, header.frequencies) == 0;
+    for (long long i = 0; ok && i < n; i++) {
+        ok = fwrite(repo->data[i].frequencies, sizeof(double), repo->data[i].count, out) == (size_t) repo->data[i].count;
+    }
+    ok = ok && WFDindex_seek(out, header.selfTerms) == 0;
+    for (long long i = 0; ok && i < n; i++) {
+        ok = fwrite(repo->data[i].selfTerms, sizeof(double), repo->data[i].count, out) == (size_t) repo->data[i].count;
+    }
+    ok = ok && WFDindex_seek(out, header.ids) == 0;
+    for (long long i = 0; ok && i < n; i++) {
+        ok = fwrite(repo->data[i].ids, sizeof(unsigned), repo->data[i].count, out) == (size_t) repo->data[i].count;
+    }
+    ok = ok && WFDindex_seek(out, header.counts) == 0;
+    for (long long i = 0; ok && i < n; i++) {
+        ok = fwrite(repo->data[i].wordCounts, sizeof(int), repo->data[i].count, out) == (size_t) repo->data[i].count;
+    }
+
+    if (fclose(out) != 0 || !ok || rename(temporary, path) == -1) {
+        warn("can't write %s", path);
+        unlink(temporary);
+        return -1;
+    }
+    return 0;
+}
+
+// maps the index at path read-only and checks that it is one this program can use. returns -1 if it can't
+// count items of size bytes starting at offset lie inside the file, checked without overflowing
+static int WFDindex_section(struct WFDindexHeader *H, long long offset, long long count, long long size) {
+    return offset >= (long long) sizeof(struct WFDindexHeader) && offset % WFDALIGNMENT == 0 && offset <= H->size
+           && count >= 0 && count <= (H->size - offset) / size;
+}
+
+// offsets[0..count] into the string section at strings: each string starts inside it and the section ends in a
+// '\0', so every string ends inside it too
+static int WFDindex_strings(struct WFDindex *X, const long long *offsets, long long count, long long strings) {
+    long long length = offsets[count];
+    if (length < 0 || length > X->header->size - strings || (length > 0 && X->map[strings + length - 1] != '\0')) {
+        return 0;
+    }
+    for (long long i = 0; i < count; i++) {
+        if (offsets[i] < 0 || offsets[i] >= length) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// everything WFDindex_load and the pairwise phase trust: section bounds, row offsets, string offsets and word ids
+static int WFDindex_valid(struct WFDindex *X) {
+    struct WFDindexHeader *H = X->header;
+    if (H->documents < 0 || H->documents >= INT_MAX || H->vocabularySize < 0 || H->vocabularySize > UINT_MAX
+        || H->nonZeros < 0
+        || !WFDindex_section(H, H->wordOffsets, H->vocabularySize + 1, sizeof(long long))
+        || !WFDindex_section(H, H->wordStrings, 0, 1)
+        || !WFDindex_section(H, H->nameOffsets, H->documents + 1, sizeof(long long))
+        || !WFDindex_section(H, H->names, 0, 1)
+        || !WFDindex_section(H, H->rows, H->documents + 1, sizeof(long long))
+        || !WFDindex_section(H, H->totalWords, H->documents, sizeof(int))
+        || !WFDindex_section(H, H->totals, H->documents, sizeof(double))
+        || !WFDindex_section(H, H->frequencies, H->nonZeros, sizeof(double))
+        || !WFDindex_section(H, H->selfTerms, H->nonZeros, sizeof(double))
+        || !WFDindex_section(H, H->ids, H->nonZeros, sizeof(unsigned))
+        || !WFDindex_section(H, H->counts, H->nonZeros, sizeof(int))) {
+        return 0;
+    }
+    if (!WFDindex_strings(X, (const long long *) (X->map + H->wordOffsets), H->vocabularySize, H->wordStrings)
+        || !WFDindex_strings(X, (const long long *) (X->map + H->nameOffsets), H->documents, H->names)) {
+        return 0;
+    }
+
+    const long long *rows = (const long long *) (X->map + H->rows);
+    const int *totalWords = (const int *) (X->map + H->totalWords);
+    if (rows[0] != 0 || rows[H->documents] != H->nonZeros) {
+        return 0;
+    }
+    for (long long i = 0; i < H->documents; i++) {
+        if (rows[i + 1] < rows[i] || rows[i + 1] - rows[i] > INT_MAX || totalWords[i] < 0) {
+            return 0;
+        }
+    }
+    // ids index the dense rows of the term-document matrix
+    const unsigned *ids = (const unsigned *) (X->map + H->ids);
+    for (long long k = 0; k < H->nonZeros; k++) {
+        if (ids[k] >= H->vocabularySize) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int WFDindex_open(struct WFDindex *X, char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        warn("can't open %s", path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(struct WFDindexHeader)) {
+        warnx("%s is not a WFD index", path);
+        close(fd);
+        return -1;
+    }
+    X->size = st.st_size;
+    X->map = mmap(NULL, X->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (X->map == MAP_FAILED) {
+        warn("can't map %s", path);
+        X->map = NULL;
+        return -1;
+    }
+    X->header = (struct WFDindexHeader *) X->map;
+
+    struct WFDindexHeader *H = X->header;
+    if (memcmp(H->magic, WFDINDEX_MAGIC, 8) != 0 || H->version != WFDINDEXVERSION || H->size != (long long) X->size) {
+        warnx("%s is not a WFD index", path);
+        WFDindex_close(X);
+        return -1;
+    }
+    if (H->tokenizerVersion != TOKENIZERVERSION) {
+        warnx("%s was written by another tokenizer version", path);
+        WFDindex_close(X);
+        return -1;
+    }
+    if (!WFDindex_valid(X)) {
+        warnx("%s is not a WFD index", path);
+        WFDindex_close(X);
+        return -1;
+    }
+    return 0;
+}
+
+// gives the index's words their ids (the same ones, as they are the first the vocabulary sees) and adds every
+// indexed document to the repository as a WFD pointing into the mapping. names go through the path store (unless
+// paths is NULL), so an indexed file named again on the command line isn't read a second time
+void WFDindex_load(struct WFDindex *X, struct WFDrepository *repo, struct pathStore *paths) {
+    struct WFDindexHeader *H = X->header;
+    const long long *wordOffsets = (const long long *) (X->map + H->wordOffsets);
+    pthread_mutex_lock(&vocab.lock);
+    for (long long id = 0; id < H->vocabularySize; id++) {
+        if (vocabulary_intern(&vocab, X->map + H->wordStrings + wordOffsets[id]) != id) {
+            errx(1, "WFD index must be loaded before any other file");
+        }
+    }
+    pthread_mutex_unlock(&vocab.lock);
+
+    const long long *nameOffsets = (const long long *) (X->map + H->nameOffsets);
+    const long long *rows = (const long long *) (X->map + H->rows);
+    const int *totalWords = (const int *) (X->map + H->totalWords);
+    const double *totals = (const double *) (X->map + H->totals);
+    for (long long i = 0; i < H->documents; i++) {
+        char *name = X->map + H->names + nameOffsets[i];
+        if (paths != NULL) {
+            int isNew;
+            name = pathStore_intern(paths, name, &isNew);
+            if (!isNew) continue;
+        }
+
+        struct WFD wfd;
+        wfd.frequencies = (double *) (X->map + H->frequencies) + rows[i];
+        wfd.selfTerms = (double *) (X->map + H->selfTerms) + rows[i];
+        wfd.ids = (unsigned *) (X->map + H->ids) + rows[i];
+        wfd.wordCounts = (int *) (X->map + H->counts) + rows[i];
+        wfd.count = (int) (rows[i + 1] - rows[i]);
+        wfd.total = totals[i];
+        wfd.block = NULL;
+        wfd.contentHash = 0;
+        WFDqueue_set(repo, WFDqueue_reserve(repo, name), &wfd, totalWords[i]);
+    }
+}
+
+void WFDindex_close(struct WFDindex *X) {
+    if (X->map != NULL) {
+        munmap(X->map, X->size);
+    }
+    X->map = NULL;
+    X->header = NULL;
+}
+
+// ------------------------------- END OF WFD INDEX -------------------------------
+
+// ------------------------------- JSD ALGORITHM -------------------------------
+
+// calculates average of two doubles. zeroflag is set when the word is not found in both lists.
+double average(double frequencyOne, double frequencyTwo, int zeroFlag) {
+    if (zeroFlag) {
+        return frequencyOne / (double) 2;
+    }
+    else {
+        return (frequencyOne + frequencyTwo) / (double) 2;
+    }
+}
+
+double calculateKLDSection(double numerator, double denominator) {
+    double ratio = numerator/denominator;
+    double logged = log2(ratio);
+    double scaled = numerator * logged;
+    return scaled;
+}
+
+double calculateJSDValue(double KLD_1, double KLD_2) {
+    double leftPart = 0.5 * KLD_1;
+    double rightPart = 0.5 * KLD_2;
+    double sum = leftPart + rightPart;
+    // identical files can come out a rounding error below 0
+    if (sum < 0.0) {
+        sum = 0.0;
+    }
+    return sqrt(sum);
+}
+
+// calculates JSD between two files.
+// both WFDs are sorted by vocabulary id, so walking both id arrays with integer compares finds every shared word.
+// a word only in one file contributes p * log2(p / (p / 2)), which is exactly p, so all of those together are the
+// file's total frequency minus the frequencies it shares: only the intersection is visited. when one WFD is much
+// longer than the other its position is moved by galloping instead of one word at a time.
+// shared words are gathered into aligned blocks and handed to JSDkernel. p * log2(p) was worked out when the WFD
+// was built, so the kernel only takes one log per shared word, the one of the mixture.
+int JSDhelper(struct WFD *WFD_1, struct WFD *WFD_2, int file1, int file2, int wordCount1, int wordCount2, struct JSDbuffer *results) {
+    double KLD_1 = 0.0;
+    double KLD_2 = 0.0;
+    const unsigned *ids1 = WFD_1->ids, *ids2 = WFD_2->ids;
+    const double *frequencies1 = WFD_1->frequencies, *frequencies2 = WFD_2->frequencies;
+    const double *selfTerms1 = WFD_1->selfTerms, *selfTerms2 = WFD_2->selfTerms;
+    int n1 = WFD_1->count, n2 = WFD_2->count;
+    int gallop1 = n1 > GALLOPRATIO * n2;
+    int gallop2 = n2 > GALLOPRATIO * n1;
+    double sharedP[JSDBLOCKSIZE] __attribute__((aligned(64)));
+    double sharedQ[JSDBLOCKSIZE] __attribute__((aligned(64)));
+    double sharedSelfP[JSDBLOCKSIZE] __attribute__((aligned(64)));
+    double sharedSelfQ[JSDBLOCKSIZE] __attribute__((aligned(64)));
+    double sharedTotal1 = 0.0, sharedTotal2 = 0.0;
+    int shared = 0;
+    int a = 0, b = 0;
+    while (a < n1 && b < n2) {
+        if (ids1[a] < ids2[b]) {  // word only in file 1
+            a = gallop1 ? WFD_seek(ids1, a, n1, ids2[b]) : a + 1;
+        }
+        else if (ids2[b] < ids1[a]) {  // word only in file 2
+            b = gallop2 ? WFD_seek(ids2, b, n2, ids1[a]) : b + 1;
+        }
+        else {  // word in both files
+            sharedP[shared] = frequencies1[a];
+            sharedQ[shared] = frequencies2[b];
+            sharedSelfP[shared] = selfTerms1[a];
+            sharedSelfQ[shared] = selfTerms2[b];
+            sharedTotal1 += frequencies1[a];
+            sharedTotal2 += frequencies2[b];
+            if (++shared == JSDBLOCKSIZE) {
+                JSDkernel(sharedP, sharedQ, sharedSelfP, sharedSelfQ, shared, &KLD_1, &KLD_2);
+                shared = 0;
+            }
+            a++;
+            b++;
+        }
     }
+    JSDkernel(sharedP, sharedQ, sharedSelfP, sharedSelfQ, shared, &KLD_1, &KLD_2);
+    // every other word is only in one of the files
+    KLD_1 = KLD_1 + (WFD_1->total - sharedTotal1);
+    KLD_2 = KLD_2 + (WFD_2->total - sharedTotal2);
 
-    // now we have exclusive access and queue is non-empty
-
-    item = Q->data[Q->head];  // write value at head to pointer
-    --Q->count;
-    ++Q->head;
-    if (Q->head == QUEUESIZE) Q->head = 0;
-
-    pthread_mutex_unlock(&Q->lock);
+    //now that we have both KLDs stored in KLD_1 and KLD_2, we can calculate and return the JSD value.
+    double JSD = calculateJSDValue(KLD_1, KLD_2);
 
-    pthread_cond_signal(&Q->write_ready);
+    // word counts come from the repository, so no file is read again here
+    int sumOfWords = wordCount1 + wordCount2;
 
+    JSDrecord(results, file1, file2, JSD, sumOfWords);
     return EXIT_SUCCESS;
 }
 
-void WFDqueue_print(struct WFDrepository *Q) {
-    int count = Q->count;
-    for (int i = 0; i < count; i++) {
-        printf("LOOKING AT FILE: %s\n", Q->fileNames[i]);
-        printList(Q->data[i]);
-        printf("\n");
+// returns the first index from start on whose id is at least target (n if there is none): steps of 1, 2, 4, ...
+// until one goes past target, then a binary search of the last step
+int WFD_seek(const unsigned *ids, int start, int n, unsigned target) {
+    int low = start, step = 1;
+    while (low + step < n && ids[low + step] < target) {
+        low += step;
+        step <<= 1;
+    }
+    int high = low + step < n ? low + step : n;  // ids[low] < target <= ids[high]
+    while (high - low > 1) {
+        int middle = low + (high - low) / 2;
+        if (ids[middle] < target) {
+            low = middle;
+        }
+        else {
+            high = middle;
+        }
     }
+    return high;
 }
 
-// ------------------------------- END OF WFD REPOSITORY QUEUE STRUCTURE -------------------------------
-
-// ------------------------------- WFD LOCAL LL -------------------------------
+// calculates JSD between two dense rows of the term-document matrix, every word of the vocabulary at once
+int JSDdenseHelper(struct termDocMatrix *M, int file1, int file2, int wordCount1, int wordCount2, struct JSDbuffer *results) {
+    double KLD_1 = 0.0;
+    double KLD_2 = 0.0;
+    size_t row1 = file1 * M->stride, row2 = file2 * M->stride;
+    JSDkernel(M->values + row1, M->values + row2, M->selfValues + row1, M->selfValues + row2, M->stride,
+              &KLD_1, &KLD_2);
+    JSDrecord(results, file1, file2, calculateJSDValue(KLD_1, KLD_2), wordCount1 + wordCount2);
+    return EXIT_SUCCESS;
+}
 
-void destroyList(struct Node *head) {
-    struct Node *curr = head;
-    while(curr != NULL)
-    {
-        struct Node *tmp = curr;
-        curr = curr->next;
-        free(tmp);
+// only the numbers are kept, the line is formatted when the results are printed
+void JSDrecord(struct JSDbuffer *results, int file1, int file2, double JSD, long long sumOfWords) {
+    results->evaluated++;
+    if (!(JSD <= results->maxJSD)) {
+        return;
+    }
+    if (results->copies == NULL) {
+        JSDbuffer_add(results, file1, file2, JSD, sumOfWords);
+        return;
+    }
+    // copies have the same word count too, so the pair's numbers hold for all of them
+    for (int copy1 = file1; copy1 != -1; copy1 = results->copies[copy1]) {
+        for (int copy2 = file2; copy2 != -1; copy2 = results->copies[copy2]) {
+            JSDbuffer_add(results, copy1, copy2, JSD, sumOfWords);
+        }
     }
 }
 
-// function to sort a singly linked list using insertion sort
-void insertionSort(struct Node **head_ref)
-{
-    // Initialize sorted linked list
-    struct Node *sorted = NULL;
-
-    // Traverse the given linked list and insert every
-    // node to sorted
-    struct Node *current = *head_ref;
-    while (current != NULL)
-    {
-        // Store next for next iteration
-        struct Node *next = current->next;
-
-        // insert current in sorted linked list
-        sortedInsert(&sorted, current);
-
-        // Update current
-        current = next;
+// every pair of copies of the same file, JSD 0 without anything to compute
+void JSDcopies(struct WFDrepository *repo, struct JSDbuffer *results) {
+    for (int i = 0; i < (int) repo->count; i++) {
+        for (int copy1 = i; copy1 != -1; copy1 = repo->nextCopy[copy1]) {
+            for (int copy2 = repo->nextCopy[copy1]; copy2 != -1; copy2 = repo->nextCopy[copy2]) {
+                JSDbuffer_add(results, copy1, copy2, 0.0, 2LL * repo->wordCounts[i]);
+            }
+        }
     }
-
-    // Update head_ref to point to sorted linked list
-    *head_ref = sorted;
 }
 
-// Function to insert a given node in a sorted linked list
-/* function to insert a new_node in a list. Note that this
-  function expects a pointer to head_ref as this can modify the
-  head of the input linked list (similar to push())*/
-void sortedInsert(struct Node** head_ref, struct Node* new_node)
-{
-    struct Node* current;
-    /* Special case for the head end */
-    // (*head_ref)->data >= new_node->data
-    if (*head_ref == NULL || strcmp((*head_ref)->data, new_node->data) >= 0)
-    {
-        new_node->next = *head_ref;
-        *head_ref = new_node;
-    }
-    else
-    {
-        /* Locate the node before the point of insertion */
-        current = *head_ref;
-        while (current->next!=NULL &&
-               //current->next->data < new_node->data)
-               strcmp(current->next->data, new_node->data) < 0)
-        {
-            current = current->next;
+// keeps one result, written out when a streaming window fills up
+void JSDbuffer_add(struct JSDbuffer *B, int file1, int file2, double JSD, long long sumOfWords) {
+    struct JSDrepository record = { file1, file2, JSD, sumOfWords };
+    if (B->limit == 0) {
+        *JSDbuffer_next(B) = record;
+        if (B->stream != NULL && B->count >= STREAMWINDOW) {
+            JSDbuffer_flush(B);
         }
-        new_node->next = current->next;
-        current->next = new_node;
+    }
+    else {
+        JSDbuffer_keep(B, &record);
     }
 }
 
-/* BELOW FUNCTIONS ARE JUST UTILITY TO TEST sortedInsert */
+int JSDmain(int file1, int file2, struct WFD * WFD_1, struct WFD * WFD_2, int wordCount1, int wordCount2, struct JSDbuffer *results) {
 
-/* Function to print linked list */
-void printList(struct Node *head)
-{
-    struct Node *temp = head;
-    while(temp != NULL)
-    {
-        printf("WORD: %s\t\tWORD COUNT: %lld\tFREQUENCY: %f\n", temp->data, temp->wordCount, temp->frequency);
-        temp = temp->next;
-    }
-}
-
-int elementExistsInLL(struct Node* head, char* new_data) {
-//    printf(" checking if %s exists in list... ", new_data);
-//    printf("THE CURRENT ELEMENTS IN THE LIST: \n");
-//    printList(head);
-//    printf("------------\n");
-    struct Node *temp = head;
-    while(temp != NULL)
-    {
-//        printf(" .. COMPARING %s to %s .. ", temp->data, new_data);
-        if (strcmp(temp->data, new_data) == 0) {
-//            printf("%s EXISTS! \n", new_data);
-            return 1;
-        }
-        temp = temp->next;
-    }
-//    printf("%s DOES NOT EXIST! \n", new_data);
-    return 0;
+    JSDhelper(WFD_1, WFD_2, file1, file2, wordCount1, wordCount2, results);
+//        printList(WFD_LL_1);
+//        printf("\n");
+//        printList(WFD_LL_2);
+
+    return EXIT_SUCCESS;
 }
 
-void incrementWordCount(struct Node* head, char* new_data) {
-    struct Node *temp = head;
-    while(temp != NULL)
-    {
-        if (strcmp(temp->data, new_data) == 0) {
-            temp->wordCount = temp->wordCount + 1;
-//            printf("WC: %lld, WF: %f", temp->wordCount, temp->frequency);
+// returns a fresh slot at the end of the buffer, growing it as needed
+struct JSDrepository * JSDbuffer_next(struct JSDbuffer *B) {
+    if (B->count == B->capacity) {
+        B->capacity = B->capacity ? B->capacity * 2 : 64;
+        B->data = realloc(B->data, B->capacity * sizeof(struct JSDrepository));
+        if (B->data == NULL) {
+            err(1, "out of memory");
         }
-        temp = temp->next;
     }
+    return &B->data[B->count++];
 }
 
-void calculateFrequency(struct Node* head, int totalNumberOfWords) {
-    struct Node *temp = head;
-    while(temp != NULL)
-    {
-//        printf(" -CALCULATING FREQUENCY!- WORDCNT: %lld, TOTAL: %d",temp->wordCount, totalNumberOfWords);
-        temp->frequency = (double)temp->wordCount / (double)totalNumberOfWords;
-//        printf(", FREQUENCY: %f", temp->frequency);
-        temp = temp->next;
+// writes the window of a streaming buffer out in output order and empties it
+void JSDbuffer_flush(struct JSDbuffer *B) {
+    qsort(B->data, B->count, sizeof(struct JSDrepository), cmp);
+    pthread_mutex_lock(&B->stream->lock);
+    for (long long i = 0; i < B->count; i++) {
+        printJSDResult(B->stream->out, &B->data[i], B->stream->repo);
     }
+    fflush(B->stream->out);
+    pthread_mutex_unlock(&B->stream->lock);
+    B->count = 0;
 }
 
-/* A utility function to insert a node at the beginning of linked list */
-void push(struct Node** head_ref, char* new_data, struct Node* head, int totalNumberOfWords)
-{
-    // if the element already exists, just increment the value of wordcount. otherwise add the node.
-    if (elementExistsInLL(head, new_data)) {
-        incrementWordCount(head, new_data);
-//        printf("INCREMENT!");
-        calculateFrequency(head, totalNumberOfWords);
+// orders results most similar first, ties in output order (cmp)
+int cmpSimilarity(const void *a, const void *b) {
+    const struct JSDrepository *left  = a;
+    const struct JSDrepository *right = b;
+    int order = (left->JSD > right->JSD) - (left->JSD < right->JSD);
+    if (order == 0) {
+        order = cmp(a, b);
     }
-    else {
-        /* allocate node */
-        struct Node* new_node = malloc(sizeof(struct Node));
-
-        /* put in the data  */
-        strcpy(new_node->data, new_data);
-
-        // init wordCount to 1
-        new_node->wordCount = 1;
-
-        // init frequency
-        new_node->frequency = (double) new_node->wordCount / (double) totalNumberOfWords;
-
-        /* link the old list off the new node */
-        new_node->next = (*head_ref);
+    return order;
+}
 
-        /* move the head to point to the new node */
-        (*head_ref)    = new_node;
+// adds a result to a buffer with a limit, a heap with its least similar result at data[0]. once the heap is full
+// a result only gets in by pushing that one out, so only the candidates that can still make the cut are kept.
+void JSDbuffer_keep(struct JSDbuffer *B, struct JSDrepository *record) {
+    struct JSDrepository *heap;
+    long long node;
+    if (B->count < B->limit) {
+        // sift up from the new leaf
+        node = B->count;
+        *JSDbuffer_next(B) = *record;
+        heap = B->data;
+        while (node > 0 && cmpSimilarity(&heap[(node - 1) / 2], &heap[node]) < 0) {
+            struct JSDrepository swap = heap[node];
+            heap[node] = heap[(node - 1) / 2];
+            heap[(node - 1) / 2] = swap;
+            node = (node - 1) / 2;
+        }
+        return;
+    }
+    heap = B->data;
+    if (cmpSimilarity(record, &heap[0]) >= 0) {
+        return;
+    }
+    // replace the top and sift it down
+    heap[0] = *record;
+    node = 0;
+    while (1) {
+        long long largest = node;
+        long long left = 2 * node + 1, right = 2 * node + 2;
+        if (left < B->count && cmpSimilarity(&heap[left], &heap[largest]) > 0) largest = left;
+        if (right < B->count && cmpSimilarity(&heap[right], &heap[largest]) > 0) largest = right;
+        if (largest == node) break;
+        struct JSDrepository swap = heap[node];
+        heap[node] = heap[largest];
+        heap[largest] = swap;
+        node = largest;
     }
 }
 
-// ------------------------------- END OF WFD LOCAL LL -------------------------------
+// maps tile pair number k to its (tile1, tile2), tile1 <= tile2. pairs are numbered column by column: column
+// tile2 holds (0, tile2) to (tile2, tile2) and starts at pair tile2 * (tile2 + 1) / 2, so every pair involving a
+// tile past some point is one contiguous range at the end
+void tilePairFromIndex(long long k, int *tile1, int *tile2) {
+    long long column = (long long) ((sqrt(8.0 * (double) k + 1.0) - 1.0) / 2.0);
+    // the square root can be off by one either way for big k
+    while (column > 0 && column * (column + 1) / 2 > k) column--;
+    while ((column + 1) * (column + 2) / 2 <= k) column++;
+    *tile2 = (int) column;
+    *tile1 = (int) (k - column * (column + 1) / 2);
+}
 
-// ------------------------------- WORD FREQUENCY ALGORITHM -------------------------------
+// formats one result as "JSD file1 file2"
+void printJSDResult(FILE *out, struct JSDrepository *result, struct WFDrepository *repo) {
+    fprintf(out, "%f %s %s\n", result->JSD, repo->fileNames[result->file1], repo->fileNames[result->file2]);
+}
 
-struct Node * findWords(char *fileName, struct Node *WFD_LL, int totalNumberOfWords) {
-    char word[100] = "";
-    int endOfWordIndex = 0;
-    size_t nbytes;
-    ssize_t bytes_read;
-    int fd;
-    FILE *fp;
-    char ch;
-    int ENDWORDFLAG = 0;
+int cmp( const void *a, const void *b )
+{
+    const struct JSDrepository *left  = a;
+    const struct JSDrepository *right = b;
 
-    fp = fopen(fileName, "r");
+    int order = ( left->wordCount < right->wordCount ) - ( right->wordCount < left->wordCount );
+    if (order == 0) {
+        // ties keep the order the pairs were generated in, whichever thread computed them
+        order = (left->file1 > right->file1) - (left->file1 < right->file1);
+    }
+    if (order == 0) {
+        order = (left->file2 > right->file2) - (left->file2 < right->file2);
+    }
+    return order;
+}
 
-    nbytes = 1;
-    char letter[2];
-    bytes_read = read(fd, letter, nbytes);
+// ------------------------------- END OF JSD ALGORITHM -------------------------------
 
-    while((ch = getc(fp)) != EOF) {
-        if (isalnum(ch) || ch == '-') {
-            ch = tolower(ch);
-//            printf("%c ", ch);
-            if (ENDWORDFLAG) { //new word
-//                printf("%s\n", word);
-                push(&WFD_LL, word, WFD_LL, totalNumberOfWords);
-                endOfWordIndex = 0;
-                ENDWORDFLAG = 0;
-                strcpy(word, "");
-
-                char tmp[2];
-                tmp[0] = ch;
-                tmp[1] = '\0';
-                strcat(word, tmp);
-                endOfWordIndex++;
-            }
-            else { //adding to a word
-                char tmp[2];
-                tmp[0] = ch;
-                tmp[1] = '\0';
-                strcat(word, tmp);
-                endOfWordIndex++;
-            }
-        }
-        else if (ch == '\''){
+// ------------------------------- JSD KERNELS -------------------------------
+
+// the kernels take a block of words, p[k] and q[k] being the word's frequency in file 1 and file 2 and selfP[k],
+// selfQ[k] their precomputed p * log2(p) and q * log2(q), and add p * log2(p / m) = selfP - p * log2(m) to *KLD_1
+// and q * log2(q / m) = selfQ - q * log2(m) to *KLD_2, m being (p + q) / 2. either frequency may be 0 (dense rows,
+// with a self term of 0): the vector log2 of 0 is a finite -1023, so those lanes come out as exactly p (or q)
+// without any masking.
+// JSDkernel points at the widest one the CPU supports (see JSDkernel_select).
+
+void JSDkernel_scalar(const double *p, const double *q, const double *selfP, const double *selfQ, int n,
+                      double *KLD_1, double *KLD_2) {
+    double sum1 = 0.0, sum2 = 0.0;
+    for (int k = 0; k < n; k++) {
+        // dense rows have zeros, a word only in one file adds exactly its frequency
+        if (q[k] == 0.0) {
+            sum1 += p[k];
             continue;
         }
-        else {
-//            printf("!FLAG SET! ");
-            ENDWORDFLAG = 1;
+        if (p[k] == 0.0) {
+            sum2 += q[k];
+            continue;
         }
+        double logM = log2(average(p[k], q[k], 0));
+        sum1 += selfP[k] - p[k] * logM;
+        sum2 += selfQ[k] - q[k] * logM;
     }
-//    printf("%s\n", word);
-    push(&WFD_LL, word, WFD_LL, totalNumberOfWords);
-    fclose(fp);
+    *KLD_1 += sum1;
+    *KLD_2 += sum2;
+}
 
-//    insertionSort(&WFD_LL);
-//    printf("================\n");
-//    printList(WFD_LL);
-    return WFD_LL;
-//    destroyList(WFD_LL);
+#if defined(__x86_64__)
+
+// vector log2 of positive normal doubles. x = m * 2^e with m in [sqrt(1/2), sqrt(2)), and
+// ln(m) = 2 * atanh(t) with t = (m - 1) / (m + 1). |t| < 0.172, so the odd series of atanh up to
+// t^15 is good to about 1e-14.
+static inline __m128d log2Approx_sse2(__m128d x) {
+    __m128i bits = _mm_castpd_si128(x);
+    // biased exponent as a double: put it in the low mantissa bits of 2^52, then take 2^52 + 1023 back off
+    __m128d e = _mm_or_pd(_mm_castsi128_pd(_mm_srli_epi64(bits, 52)), _mm_set1_pd(4503599627370496.0));
+    e = _mm_sub_pd(e, _mm_set1_pd(4503599627370496.0 + 1023.0));
+    __m128d m = _mm_and_pd(x, _mm_castsi128_pd(_mm_set1_epi64x(0x000fffffffffffffLL)));
+    m = _mm_or_pd(m, _mm_set1_pd(1.0));  // mantissa in [1, 2)
+    __m128d big = _mm_cmpgt_pd(m, _mm_set1_pd(1.4142135623730951));
+    m = _mm_or_pd(_mm_andnot_pd(big, m), _mm_and_pd(big, _mm_mul_pd(m, _mm_set1_pd(0.5))));
+    e = _mm_add_pd(e, _mm_and_pd(big, _mm_set1_pd(1.0)));
+
+    __m128d t = _mm_div_pd(_mm_sub_pd(m, _mm_set1_pd(1.0)), _mm_add_pd(m, _mm_set1_pd(1.0)));
+    __m128d t2 = _mm_mul_pd(t, t);
+    __m128d series = _mm_set1_pd(1.0 / 15.0);
+    series = _mm_add_pd(_mm_mul_pd(series, t2), _mm_set1_pd(1.0 / 13.0));
+    series = _mm_add_pd(_mm_mul_pd(series, t2), _mm_set1_pd(1.0 / 11.0));
+    series = _mm_add_pd(_mm_mul_pd(series, t2), _mm_set1_pd(1.0 / 9.0));
+    series = _mm_add_pd(_mm_mul_pd(series, t2), _mm_set1_pd(1.0 / 7.0));
+    series = _mm_add_pd(_mm_mul_pd(series, t2), _mm_set1_pd(1.0 / 5.0));
+    series = _mm_add_pd(_mm_mul_pd(series, t2), _mm_set1_pd(1.0 / 3.0));
+    series = _mm_add_pd(_mm_mul_pd(series, t2), _mm_set1_pd(1.0));
+    // log2(x) = e + 2 * t * series / ln(2)
+    return _mm_add_pd(e, _mm_mul_pd(_mm_mul_pd(t, series), _mm_set1_pd(2.0 * M_LOG2E)));
 }
 
-int findNumberOfWords(char * fileName) {
-//    static struct termios oldt, newt;
-
-//    /*tcgetattr gets the parameters of the current terminal
-//    STDIN_FILENO will tell tcgetattr that it should write the settings
-//    of stdin to oldt*/
-//    tcgetattr( STDIN_FILENO, &oldt);
-//    /*now the settings will be copied*/
-//    newt = oldt;
-//
-//    /*ICANON normally takes care that one line at a time will be processed
-//    that means it will return if it sees a "\n" or an EOF or an EOL*/
-//    newt.c_lflag &= ~(ICANON);
-//
-//    /*Those new settings will be set to STDIN
-//    TCSANOW tells tcsetattr to change attributes immediately. */
-//    tcsetattr( STDIN_FILENO, TCSANOW, &newt);
-
-//    system ("/bin/stty raw");
-
-    char word[100] = "";
-    int endOfWordIndex = 0;
-    size_t nbytes;
-//    ssize_t bytes_read;
-    int fd;
-//    FILE *fp;
-    char ch;
-    int ENDWORDFLAG = 0;
-    int totalNumberOfWords = 0;
-
-    fd = open(fileName, O_RDONLY);
-
-    nbytes = 1;
-//    char letter[2];
-//    bytes_read = read(fd, letter, nbytes);
-    // read_s <-- int
-    // read_s = read(fd, buffer, count)
-    // make sure read_s is > 0
-    int readBytes = 0;
-    char buffer[1];
-    while((readBytes = read(fd, buffer, 1)) > 0) {
-        ch = buffer[0];
-        if (isalnum(ch) || ch == '-') {
-            ch = tolower(ch);
-//            printf("%c ", ch);
-            if (ENDWORDFLAG) { //new word
-                totalNumberOfWords++;
-                endOfWordIndex = 0;
-                ENDWORDFLAG = 0;
-                strcpy(word, "");
-
-                char tmp[2];
-                tmp[0] = ch;
-                tmp[1] = '\0';
-                strcat(word, tmp);
-                endOfWordIndex++;
-            }
-            else { //adding to a word
-                char tmp[2];
-                tmp[0] = ch;
-                tmp[1] = '\0';
-                strcat(word, tmp);
-                endOfWordIndex++;
-            }
-        }
-        else if (ch == '\''){
-            continue;
-        }
-        else {
-//            printf("!FLAG SET! ");
-            ENDWORDFLAG = 1;
-        }
+void JSDkernel_sse2(const double *p, const double *q, const double *selfP, const double *selfQ, int n,
+                    double *KLD_1, double *KLD_2) {
+    __m128d sum1 = _mm_setzero_pd(), sum2 = _mm_setzero_pd();
+    __m128d half = _mm_set1_pd(0.5);
+    int k = 0;
+    for (; k + 2 <= n; k += 2) {
+        __m128d P = _mm_loadu_pd(p + k), Q = _mm_loadu_pd(q + k);
+        __m128d logM = log2Approx_sse2(_mm_mul_pd(_mm_add_pd(P, Q), half));
+        sum1 = _mm_add_pd(sum1, _mm_sub_pd(_mm_loadu_pd(selfP + k), _mm_mul_pd(P, logM)));
+        sum2 = _mm_add_pd(sum2, _mm_sub_pd(_mm_loadu_pd(selfQ + k), _mm_mul_pd(Q, logM)));
     }
-    totalNumberOfWords++;
+    double lanes1[2], lanes2[2];
+    _mm_storeu_pd(lanes1, sum1);
+    _mm_storeu_pd(lanes2, sum2);
+    *KLD_1 += lanes1[0] + lanes1[1];
+    *KLD_2 += lanes2[0] + lanes2[1];
+    JSDkernel_scalar(p + k, q + k, selfP + k, selfQ + k, n - k, KLD_1, KLD_2);
+}
 
-//    fclose(fp);
+// same as log2Approx_sse2, four lanes at a time
+__attribute__((target("avx2"))) static inline __m256d log2Approx_avx2(__m256d x) {
+    __m256i bits = _mm256_castpd_si256(x);
+    __m256d e = _mm256_or_pd(_mm256_castsi256_pd(_mm256_srli_epi64(bits, 52)), _mm256_set1_pd(4503599627370496.0));
+    e = _mm256_sub_pd(e, _mm256_set1_pd(4503599627370496.0 + 1023.0));
+    __m256d m = _mm256_and_pd(x, _mm256_castsi256_pd(_mm256_set1_epi64x(0x000fffffffffffffLL)));
+    m = _mm256_or_pd(m, _mm256_set1_pd(1.0));
+    __m256d big = _mm256_cmp_pd(m, _mm256_set1_pd(1.4142135623730951), _CMP_GT_OQ);
+    m = _mm256_blendv_pd(m, _mm256_mul_pd(m, _mm256_set1_pd(0.5)), big);
+    e = _mm256_add_pd(e, _mm256_and_pd(big, _mm256_set1_pd(1.0)));
+
+    __m256d t = _mm256_div_pd(_mm256_sub_pd(m, _mm256_set1_pd(1.0)), _mm256_add_pd(m, _mm256_set1_pd(1.0)));
+    __m256d t2 = _mm256_mul_pd(t, t);
+    __m256d series = _mm256_set1_pd(1.0 / 15.0);
+    series = _mm256_add_pd(_mm256_mul_pd(series, t2), _mm256_set1_pd(1.0 / 13.0));
+    series = _mm256_add_pd(_mm256_mul_pd(series, t2), _mm256_set1_pd(1.0 / 11.0));
+    series = _mm256_add_pd(_mm256_mul_pd(series, t2), _mm256_set1_pd(1.0 / 9.0));
+    series = _mm256_add_pd(_mm256_mul_pd(series, t2), _mm256_set1_pd(1.0 / 7.0));
+    series = _mm256_add_pd(_mm256_mul_pd(series, t2), _mm256_set1_pd(1.0 / 5.0));
+    series = _mm256_add_pd(_mm256_mul_pd(series, t2), _mm256_set1_pd(1.0 / 3.0));
+    series = _mm256_add_pd(_mm256_mul_pd(series, t2), _mm256_set1_pd(1.0));
+    return _mm256_add_pd(e, _mm256_mul_pd(_mm256_mul_pd(t, series), _mm256_set1_pd(2.0 * M_LOG2E)));
+}
 
-//    /*restore the old settings*/
-//    tcsetattr( STDIN_FILENO, TCSANOW, &oldt);
+__attribute__((target("avx2"))) void JSDkernel_avx2(const double *p, const double *q, const double *selfP,
+                                                    const double *selfQ, int n, double *KLD_1, double *KLD_2) {
+    __m256d sum1 = _mm256_setzero_pd(), sum2 = _mm256_setzero_pd();
+    __m256d half = _mm256_set1_pd(0.5);
+    int k = 0;
+    for (; k + 4 <= n; k += 4) {
+        __m256d P = _mm256_loadu_pd(p + k), Q = _mm256_loadu_pd(q + k);
+        __m256d logM = log2Approx_avx2(_mm256_mul_pd(_mm256_add_pd(P, Q), half));
+        sum1 = _mm256_add_pd(sum1, _mm256_sub_pd(_mm256_loadu_pd(selfP + k), _mm256_mul_pd(P, logM)));
+        sum2 = _mm256_add_pd(sum2, _mm256_sub_pd(_mm256_loadu_pd(selfQ + k), _mm256_mul_pd(Q, logM)));
+    }
+    double lanes1[4], lanes2[4];
+    _mm256_storeu_pd(lanes1, sum1);
+    _mm256_storeu_pd(lanes2, sum2);
+    *KLD_1 += (lanes1[0] + lanes1[1]) + (lanes1[2] + lanes1[3]);
+    *KLD_2 += (lanes2[0] + lanes2[1]) + (lanes2[2] + lanes2[3]);
+    JSDkernel_scalar(p + k, q + k, selfP + k, selfQ + k, n - k, KLD_1, KLD_2);
+}
 
-//    system ("/bin/stty cooked");
+#endif
 
-    return totalNumberOfWords;
+// picks the widest kernel the CPU running us supports
+void JSDkernel_select(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        JSDkernel = JSDkernel_avx2;
+    }
+    else {
+        JSDkernel = JSDkernel_sse2;  // part of every x86-64 CPU
+    }
+#else
+    JSDkernel = JSDkernel_scalar;
+#endif
 }
 
-struct Node * WFDmain(char* fileName, struct Node *WFD_LL) {
-//    FILE *fp;
-//    fp = fopen(fileName, "r");
-//    fclose(fp);
+// ------------------------------- END OF JSD KERNELS -------------------------------
 
-    int meme = strcmp("2292992", fileName);
-//    printf("Reading file: %s \t. . . OK!", fileName);
-//    sleep(1);
-//    printf("\t||NOW READING: %d||\n", meme);
-//    fflush(stdout);
-    char * tmp = fileName;
+// ------------------------------- TERM-DOCUMENT MATRIX -------------------------------
 
-    // steps to WFD classify:
-    //  1) obtain text from file.
-    //  2) iterate through text character by character, make all lowercase. if space, set spaceFlag.
-    //  3) so long as spaceFlag is not set, concat each read character into a word.
-    //  4) print word (debugging)
+// packs every WFD of the repository into M (see termDocMatrix_pack). the dense rows are only built when enough of the matrix is non-zero and it fits in DENSEMATRIXBYTES.
+void termDocMatrix_build(struct termDocMatrix *M, struct WFDrepository *repo, int analysisThreads, int archived) {
+    int n = repo->count;
+    long long nonZeros = 0;
+    for (int i = 0; i < n; i++) {
+        nonZeros += repo->data[i].count;
+    }
 
-    // returns total number of words in the file
-    int totalNumberOfWords = findNumberOfWords(tmp);
-//    int totalNumberOfWords = 10000;
+    M->n = n;
+    M->archived = archived;
+    M->vocabularySize = vocab.count;
+    M->docs = malloc(n * sizeof(struct WFD) + 1);
+    if (M->docs == NULL) {
+        err(1, "out of memory");
+    }
 
-//    printf("\n");
-//    printf("\t||total number of words: %d||\n", totalNumberOfWords);
+    // documents straight from an index are already laid out like this, their arrays are used where they are
+    M->borrowed = n > 0;
+    long long offset = 0;
+    for (int i = 0; i < n && M->borrowed; i++) {
+        struct WFD *wfd = &repo->data[i];
+        M->borrowed = wfd->block == NULL
+                      && wfd->frequencies == repo->data[0].frequencies + offset
+                      && wfd->selfTerms == repo->data[0].selfTerms + offset
+                      && wfd->ids == repo->data[0].ids + offset
+                      && wfd->wordCounts == repo->data[0].wordCounts + offset;
+        offset += wfd->count;
+    }
+    if (M->borrowed) {
+        M->frequencies = repo->data[0].frequencies;
+        M->selfTerms = repo->data[0].selfTerms;
+        M->ids = repo->data[0].ids;
+        M->wordCounts = repo->data[0].wordCounts;
+        memcpy(M->docs, repo->data, n * sizeof(struct WFD));
+    }
+    else {
+        termDocMatrix_pack(M, repo, nonZeros);
+    }
 
-    // appends words to the linkedList of word frequencies
-    return findWords(fileName, WFD_LL, totalNumberOfWords);
+    // rows are padded to whole cache lines, the padding is zero and adds nothing to the JSD
+    M->stride = (M->vocabularySize + 7) & ~(size_t) 7;
+    double cells = (double) n * (double) M->stride;
+    double density = cells > 0 ? (double) nonZeros / cells : 0.0;
+    M->dense = density >= DENSETHRESHOLD && 2 * cells * sizeof(double) <= DENSEMATRIXBYTES;
+    M->values = NULL;
+    M->selfValues = NULL;
+    if (M->dense) {
+        // frequencies and self terms in one block, the self terms right after the last row of frequencies
+        void *block;
+        if (posix_memalign(&block, WFDALIGNMENT, 2 * (size_t) cells * sizeof(double) + WFDALIGNMENT) != 0) {
+            err(1, "out of memory");
+        }
+        M->values = block;
+        M->selfValues = M->values + (size_t) cells;
+        memset(M->values, 0, 2 * (size_t) cells * sizeof(double));
+        for (int i = 0; i < n; i++) {
+            double *values = M->values + i * M->stride;
+            double *selfValues = M->selfValues + i * M->stride;
+            for (int k = 0; k < M->docs[i].count; k++) {
+                values[M->docs[i].ids[k]] = M->docs[i].frequencies[k];
+                selfValues[M->docs[i].ids[k]] = M->docs[i].selfTerms[k];
+            }
+        }
+    }
 
+    // as many documents per tile as fit in TILEBYTES, but enough tiles that every analysis thread gets several
+    double bytesPerDocument = M->dense ? 2 * M->stride * sizeof(double)
+                                       : (n > 0 ? (double) nonZeros / n : 0.0) * (2 * sizeof(double) + sizeof(unsigned));
+    int tileSize = bytesPerDocument > 0 ? (int) (TILEBYTES / bytesPerDocument) : n;
+    int tilesWanted = (int) ceil(sqrt(2.0 * analysisThreads * PAIRCHUNKSPERTHREAD));
+    int tileSizeForThreads = (n + tilesWanted - 1) / tilesWanted;
+    if (tileSize > tileSizeForThreads) tileSize = tileSizeForThreads;
+    if (tileSize < 1) tileSize = 1;
+    M->tileSize = tileSize;
+    M->tiles = (n + tileSize - 1) / tileSize;
 }
 
-// ------------------------------- END OF WORD FREQUENCY ALGORITHM -------------------------------
+// copies every WFD of the repository into the matrix's own arrays and points the repository's WFDs at their rows,
+// freeing the per-file arrays
+void termDocMatrix_pack(struct termDocMatrix *M, struct WFDrepository *repo, long long nonZeros) {
+    M->frequencies = malloc(nonZeros * sizeof(double) + 1);
+    M->selfTerms = malloc(nonZeros * sizeof(double) + 1);
+    M->ids = malloc(nonZeros * sizeof(unsigned) + 1);
+    M->wordCounts = malloc(nonZeros * sizeof(int) + 1);
+    if (M->frequencies == NULL || M->selfTerms == NULL || M->ids == NULL || M->wordCounts == NULL) {
+        err(1, "out of memory");
+    }
 
-// ------------------------------- JSD ALGORITHM -------------------------------
+    long long offset = 0;
+    int n = M->n;
+    for (int i = 0; i < n; i++) {
+        struct WFD *wfd = &repo->data[i];
+        struct WFD *row = &M->docs[i];
+        memcpy(M->frequencies + offset, wfd->frequencies, wfd->count * sizeof(double));
+        memcpy(M->selfTerms + offset, wfd->selfTerms, wfd->count * sizeof(double));
+        memcpy(M->ids + offset, wfd->ids, wfd->count * sizeof(unsigned));
+        memcpy(M->wordCounts + offset, wfd->wordCounts, wfd->count * sizeof(int));
+        row->frequencies = M->frequencies + offset;
+        row->selfTerms = M->selfTerms + offset;
+        row->ids = M->ids + offset;
+        row->wordCounts = M->wordCounts + offset;
+        row->count = wfd->count;
+        row->total = wfd->total;
+        row->block = NULL;
+        row->contentHash = wfd->contentHash;
+        offset += wfd->count;
+
+        WFD_destroy(wfd);
+        *wfd = *row;
+    }
+}
 
-// calculates average of two doubles. zeroflag is set when the word is not found in both lists.
-double average(double frequencyOne, double frequencyTwo, int zeroFlag) {
-    if (zeroFlag) {
-        return frequencyOne / (double) 2;
+void termDocMatrix_destroy(struct termDocMatrix *M) {
+    free(M->docs);
+    if (!M->borrowed) {
+        free(M->frequencies);
+        free(M->selfTerms);
+        free(M->ids);
+        free(M->wordCounts);
     }
-    else {
-        return (frequencyOne + frequencyTwo) / (double) 2;
+    free(M->values);
+    M->docs = NULL;
+    M->values = NULL;
+    M->selfValues = NULL;
+}
+
+// computes every pair between the documents of two tiles (only the upper triangle when it is the same tile)
+void JSDtile(struct termDocMatrix *M, struct WFDrepository *repo, int tile1, int tile2, struct JSDbuffer *results) {
+    int start1 = tile1 * M->tileSize, end1 = start1 + M->tileSize;
+    int start2 = tile2 * M->tileSize, end2 = start2 + M->tileSize;
+    if (end1 > M->n) end1 = M->n;
+    if (end2 > M->n) end2 = M->n;
+    for (int i = start1; i < end1; i++) {
+        int first = tile1 == tile2 ? i + 1 : start2;
+        // two archived documents are never compared
+        if (i < M->archived && first < M->archived) first = M->archived;
+        for (int j = first; j < end2; j++) {
+            JSDpair(M, repo, i, j, results);
+        }
     }
 }
 
-void traverseWordlist(struct Node *head) {
-    struct Node *temp = head;
-    while(temp != NULL)
-    {
-        printf("WORD: %s\t\tWORD COUNT: %lld\tFREQUENCY: %f\n", temp->data, temp->wordCount, temp->frequency);
-        temp = temp->next;
+// computes one pair from whichever rows the matrix has
+void JSDpair(struct termDocMatrix *M, struct WFDrepository *repo, int file1, int file2, struct JSDbuffer *results) {
+    if (M->dense) {
+        JSDdenseHelper(M, file1, file2, repo->wordCounts[file1], repo->wordCounts[file2], results);
+    }
+    else {
+        JSDmain(file1, file2, &M->docs[file1], &M->docs[file2], repo->wordCounts[file1], repo->wordCounts[file2], results);
     }
 }
 
-double calculateKLDSection(double numerator, double denominator) {
-    double ratio = numerator/denominator;
-    double logged = log2(ratio);
-    double scaled = numerator * logged;
-    return scaled;
+// ------------------------------- END OF TERM-DOCUMENT MATRIX -------------------------------
+
+// ------------------------------- MINHASH CANDIDATES -------------------------------
+
+// 64 bit mix of a vocabulary id (the splitmix64 finalizer)
+unsigned long long hashId(unsigned long long x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
 }
 
-double calculateJSDValue(double KLD_1, double KLD_2) {
-    double leftPart = 0.5 * KLD_1;
-    double rightPart = 0.5 * KLD_2;
-    double sum = leftPart + rightPart;
-    return sqrt(sum);
+// fills the MinHash signatures of a range of documents. hash function k of a word is h1 + k * h2, h1 and h2 being
+// the two halves of one mix of the word, so each word is only mixed once whatever the signature length.
+void *minhashWorker(void *arg) {
+    struct minhashArgs *args = arg;
+    struct termDocMatrix *M = args->matrix;
+    for (int i = args->start; i < args->end; i++) {
+        unsigned long long *signature = args->signatures + (size_t) i * args->hashes;
+        for (int k = 0; k < args->hashes; k++) {
+            signature[k] = ~0ULL;
+        }
+        for (int w = 0; w < M->docs[i].count; w++) {
+            unsigned long long h1 = args->wordHashes[M->docs[i].ids[w]];
+            unsigned long long h2 = (h1 >> 32 | h1 << 32) | 1;
+            unsigned long long h = h1;
+            for (int k = 0; k < args->hashes; k++) {
+                if (h < signature[k]) signature[k] = h;
+                h += h2;
+            }
+        }
+    }
+    return NULL;
 }
 
-// calculates JSD between two files
-int JSDhelper(struct Node *WFD_LL_1, struct Node *WFD_LL_2, char * file1, char * file2, struct JSDrepository *array) {
-//    printList(WFD_LL_1);
-//    printf("\n");
-//    printList(WFD_LL_2);
+int cmpBandEntry(const void *a, const void *b) {
+    const struct bandEntry *left = a;
+    const struct bandEntry *right = b;
+    int order = (left->key > right->key) - (left->key < right->key);
+    if (order == 0) {
+        order = (left->doc > right->doc) - (left->doc < right->doc);
+    }
+    return order;
+}
 
-    double KLD_1 = 0.0;
-    struct Node *temp = WFD_LL_1;
-    while(temp != NULL) {
-        char * currWord = temp->data;
-        double temp2Frequency = 0.0;
-        struct Node *temp2 = WFD_LL_2;
-        double wordAverage = 0.0;
-//        printf("FILE 1: WORD: %s\t\tWORD COUNT: %lld\tFREQUENCY: %f\n", temp->data, temp->wordCount, temp->frequency);
-        while (temp2 != NULL) {
-//            printf("FILE 2: WORD: %s\t\tWORD COUNT: %lld\tFREQUENCY: %f\n", temp2->data, temp2->wordCount, temp2->frequency);
-            if (strcmp(currWord, temp2->data) == 0) {
-//                printf("MATCH FOUND!\n");
-                temp2Frequency = temp2->frequency;
-                temp2 = NULL;
-            }
-            else {
-                temp2 = temp2->next;
+// locality-sensitive hashing over MinHash signatures: each signature is cut into bands of LSHROWS values, and two
+// documents become a candidate pair when all the values of at least one band agree. documents that share most of
+// their vocabulary almost surely do; documents with little in common almost surely don't.
+// *pairs gets the candidates, encoded as file1 << 32 | file2 with file1 < file2 and in ascending order.
+// returns how many there are
+long long minhash_candidates(struct termDocMatrix *M, int bands, int threads, unsigned long long **pairs) {
+    int archived = M->archived;
+    int n = M->n;
+    int hashes = bands * LSHROWS;
+    unsigned long long *signatures = malloc((size_t) n * hashes * sizeof(unsigned long long) + 1);
+    struct minhashArgs *minhashArgs = calloc(threads, sizeof(struct minhashArgs));
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    // words are hashed by their text, not their id: ids are handed out in whatever order the readers meet the
+    // words, and the candidates mustn't depend on that
+    unsigned long long *wordHashes = malloc(vocab.count * sizeof(unsigned long long) + 1);
+    if (signatures == NULL || minhashArgs == NULL || workers == NULL || wordHashes == NULL) {
+        err(1, "out of memory");
+    }
+    for (unsigned id = 0; id < vocab.count; id++) {
+        wordHashes[id] = hashId(hashWord(vocab.words[id]));
+    }
+    for (int t = 0; t < threads; t++) {
+        minhashArgs[t].matrix = M;
+        minhashArgs[t].signatures = signatures;
+        minhashArgs[t].wordHashes = wordHashes;
+        minhashArgs[t].hashes = hashes;
+        minhashArgs[t].start = (int) ((long long) n * t / threads);
+        minhashArgs[t].end = (int) ((long long) n * (t + 1) / threads);
+    }
+    startThreads(workers, threads, minhashWorker, minhashArgs, sizeof(struct minhashArgs));
+    joinThreads(workers, threads);
+    free(workers);
+    free(minhashArgs);
+    free(wordHashes);
+
+    struct bandEntry *entries = malloc(n * sizeof(struct bandEntry) + 1);
+    long long count = 0, capacity = 1024;
+    unsigned long long *found = malloc(capacity * sizeof(unsigned long long));
+    if (entries == NULL || found == NULL) {
+        err(1, "out of memory");
+    }
+    for (int band = 0; band < bands; band++) {
+        for (int i = 0; i < n; i++) {
+            unsigned long long key = band;
+            for (int r = 0; r < LSHROWS; r++) {
+                key = hashId(key ^ signatures[(size_t) i * hashes + band * LSHROWS + r]);
             }
+            entries[i].key = key;
+            entries[i].doc = i;
         }
-        if (temp2Frequency == 0.0) {
-            wordAverage = average(temp->frequency, temp2Frequency, 1);
+        qsort(entries, n, sizeof(struct bandEntry), cmpBandEntry);
+
+        // every two documents of a bucket are a candidate
+        for (int first = 0, last; first < n; first = last) {
+            for (last = first + 1; last < n && entries[last].key == entries[first].key; last++);
+            for (int a = first; a < last; a++) {
+                for (int b = a + 1; b < last; b++) {
+                    if (entries[a].doc < archived && entries[b].doc < archived) continue;
+                    if (count == capacity) {
+                        capacity *= 2;
+                        found = realloc(found, capacity * sizeof(unsigned long long));
+                        if (found == NULL) {
+                            err(1, "out of memory");
+                        }
+                    }
+                    found[count++] = (unsigned long long) entries[a].doc << 32 | (unsigned) entries[b].doc;
+                }
+            }
         }
-        else {
-            wordAverage = average(temp->frequency, temp2Frequency, 0);
+    }
+    free(entries);
+    free(signatures);
+
+    // a pair can share several bands
+    qsort(found, count, sizeof(unsigned long long), cmpPacked);
+    long long unique = 0;
+    for (long long k = 0; k < count; k++) {
+        if (unique == 0 || found[k] != found[unique - 1]) {
+            found[unique++] = found[k];
         }
-//        printf("AVERAGE FREQUENCY FOR WORD \"%s\" IN BOTH FILES IS %f. ACTUAL FREQUENCY: %f\n", temp->data, wordAverage, temp->frequency);
-        double KLDsection = calculateKLDSection(temp->frequency, wordAverage);
-        KLD_1 = KLD_1 + KLDsection;
-        temp = temp->next;
     }
+    *pairs = found;
+    return unique;
+}
 
-//    printf("\nKLD RESULT: %f\n", KLD_1);
+// ------------------------------- END OF MINHASH CANDIDATES -------------------------------
 
-//    printf("\n===================================\n\n");
+// ------------------------------- THREADS -------------------------------
 
-    double KLD_2 = 0.0;
-    struct Node *temp2b = WFD_LL_2;
-    while(temp2b != NULL) {
-        char * currWord = temp2b->data;
-        double temp2Frequency = 0.0;
-        struct Node *temp2 = WFD_LL_1;
-        double wordAverage = 0.0;
-//        printf("FILE 2: WORD: %s\t\tWORD COUNT: %lld\tFREQUENCY: %f\n", temp2b->data, temp2b->wordCount, temp2b->frequency);
-        while (temp2 != NULL) {
-//            printf("FILE 1: WORD: %s\t\tWORD COUNT: %lld\tFREQUENCY: %f\n", temp2->data, temp2->wordCount, temp2->frequency);
-            if (strcmp(currWord, temp2->data) == 0) {
-//                printf("MATCH FOUND!\n");
-                temp2Frequency = temp2->frequency;
-                temp2 = NULL;
-            }
-            else {
-                temp2 = temp2->next;
+// directory walker: lists directories from its own deque, or steals them from another walker's, feeding found
+// files to the file queue and found subdirectories to its own deque
+void *directoryWorker(void *arg) {
+    struct walkerArgs *args = arg;
+    char *dirName;
+    while (walkPool_take(args->pool, args->self, &dirName) == EXIT_SUCCESS) {
+        walkDirectory(args->pool, args->self, dirName);
+        free(dirName);
+        walkPool_done(args->pool);
+    }
+    stats_addThreadCPU(PHASE_TRAVERSAL);
+    return NULL;
+}
+
+// file reader: builds the WFD of every file taken off the file queue and stores it in the repository
+void *fileWorker(void *arg) {
+    struct readerArgs *args = arg;
+    char *fileName;
+    while (queue_remove(args->files, &fileName) == EXIT_SUCCESS) {
+        int index = WFDqueue_reserve(args->repo, fileName);
+
+        struct WFD wfd;
+        // unreadable files keep a word count of -1 and are dropped by WFDqueue_compact
+        int wordCount = WFDmain(fileName, &wfd);
+        WFDqueue_set(args->repo, index, &wfd, wordCount);
+    }
+    stats_addThreadCPU(PHASE_WFD);
+    return NULL;
+}
+
+// analysis: claims pairs of tiles of the term-document matrix (see tilePairFromIndex) and writes the results into
+// its own buffer without any locking. tiles are all the same size, so the long early rows of the triangle are
+// spread over every thread.
+// with the MinHash filter on it claims chunks of the candidate pairs instead.
+void *analysisWorker(void *arg) {
+    struct analysisArgs *args = arg;
+    struct termDocMatrix *matrix = args->matrix;
+    struct pairCursor *cursor = args->cursor;
+    while (1) {
+        pthread_mutex_lock(&cursor->lock);
+        long long start = cursor->next;
+        cursor->next += cursor->chunkSize;
+        pthread_mutex_unlock(&cursor->lock);
+        if (start >= cursor->total) break;
+
+        long long end = start + cursor->chunkSize;
+        if (end > cursor->total) end = cursor->total;
+
+        if (args->candidates != NULL) {
+            for (long long k = start; k < end; k++) {
+                JSDpair(matrix, args->repo, (int) (args->candidates[k] >> 32),
+                        (int) (args->candidates[k] & 0xffffffffu), &args->results);
             }
+            continue;
         }
-        if (temp2Frequency == 0.0) {
-            wordAverage = average(temp2b->frequency, temp2Frequency, 1);
+        for (long long k = start; k < end; k++) {
+            int tile1, tile2;
+            tilePairFromIndex(k, &tile1, &tile2);
+            JSDtile(matrix, args->repo, tile1, tile2, &args->results);
         }
-        else {
-            wordAverage = average(temp2b->frequency, temp2Frequency, 0);
+    }
+    if (args->results.stream != NULL && args->results.count > 0) {
+        JSDbuffer_flush(&args->results);
+    }
+    return NULL;
+}
+
+// starts count threads running routine. thread i gets arg + i * argStride, so a stride of 0 shares one argument.
+// dies if any of them can't be created
+void startThreads(pthread_t *threads, int count, void *(*routine)(void *), void *arg, size_t argStride) {
+    for (int i = 0; i < count; i++) {
+        int r = pthread_create(&threads[i], NULL, routine, (char *) arg + i * argStride);
+        if (r != 0) {
+            errno = r;
+            err(1, "can't create thread");
         }
-//        printf("AVERAGE FREQUENCY FOR WORD \"%s\" IN BOTH FILES IS %f. ACTUAL FREQUENCY: %f\n", temp2b->data, wordAverage, temp2b->frequency);
-        double KLDsection = calculateKLDSection(temp2b->frequency, wordAverage);
-        KLD_2 = KLD_2 + KLDsection;
-        temp2b = temp2b->next;
     }
+}
+
+void joinThreads(pthread_t *threads, int count) {
+    for (int i = 0; i < count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
 
-//    printf("\nKLD RESULT: %f\n", KLD_2);
+// ------------------------------- END OF THREADS -------------------------------
 
-    //now that we have both KLDs stored in KLD_1 and KLD_2, we can calculate and return the JSD value.
-    double JSD = calculateJSDValue(KLD_1, KLD_2);
+// ------------------------------- RUN STATISTICS -------------------------------
 
-    int numberOfWordsInFile1 = findNumberOfWords(file1);
-    int numberOfWordsInFile2 = findNumberOfWords(file2);
-    int sumOfWords = numberOfWordsInFile1 + numberOfWordsInFile2;
-
-//    printf("%f %s %s TOTAL # OF WORDS: %d\n", JSD, file1, file2, sumOfWords);
-    char totalChar[1000];
-    char snum[10];
-    sprintf(snum,"%f",JSD);
-    strcpy(totalChar, snum);
-    strcat(totalChar, " ");
-    strcat(totalChar, file1);
-    strcat(totalChar, " ");
-    strcat(totalChar, file2);
-    array[JSDArrayIndex].wordCount = sumOfWords;
-    strcpy(array[JSDArrayIndex].string, totalChar);
-//    printf("ADDING %s AT %d\n", totalChar, JSDArrayIndex);
-//    printf("%s %d\n", array[JSDArrayIndex].string, array[JSDArrayIndex].wordCount);
-    JSDArrayIndex++;
-}
-
-int JSDmain(char * file1, char * file2, struct Node * WFD_LL_1, struct Node * WFD_LL_2, struct JSDrepository *array) {
-
-    JSDhelper(WFD_LL_1, WFD_LL_2, file1, file2, array);
-//        printList(WFD_LL_1);
-//        printf("\n");
-//        printList(WFD_LL_2);
+static const char *phaseNames[PHASES] = { "traversal", "WFD construction", "pairwise JSD", "sort/output" };
+static const char *phaseKeys[PHASES] = { "traversal", "wfd", "jsd", "output" };
 
-    return EXIT_SUCCESS;
+// seconds on clock, CLOCK_MONOTONIC for wall time or one of the CPU time clocks
+double stats_clock(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
 }
 
-int cmp( const void *a, const void *b )
-{
-    const struct JSDrepository *left  = a;
-    const struct JSDrepository *right = b;
+// called by a worker as it finishes, its whole CPU time goes to phase
+void stats_addThreadCPU(int phase) {
+    struct timespec used;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &used) == 0) {
+        __atomic_add_fetch(&stats.cpu[phase], used.tv_sec * 1000000000LL + used.tv_nsec, __ATOMIC_RELAXED);
+    }
+}
 
-    return ( left->wordCount < right->wordCount ) - ( right->wordCount < left->wordCount );
+static long peakRSS(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == -1) {
+        return 0;
+    }
+    return usage.ru_maxrss;  // kilobytes on Linux
 }
 
-// ------------------------------- END OF JSD ALGORITHM -------------------------------
+void stats_print(FILE *out, struct runStats *S) {
+    fprintf(out, "%-18s %12s %12s\n", "phase", "wall ms", "cpu ms");
+    for (int i = 0; i < PHASES; i++) {
+        fprintf(out, "%-18s %12.3f %12.3f\n", phaseNames[i], S->wall[i] * 1e3, S->cpu[i] * 1e-6);
+    }
+    fprintf(out, "files              %d\n", S->files);
+    fprintf(out, "duplicate files    %d\n", S->duplicates);
+    fprintf(out, "bytes read         %lld\n", S->bytesRead);
+    fprintf(out, "tokens             %lld\n", S->tokens);
+    fprintf(out, "distinct words     %.1f per file, %d at most\n",
+            S->files > 0 ? (double) S->distinctWords / S->files : 0.0, S->maxDistinctWords);
+    fprintf(out, "pairs evaluated    %lld\n", S->pairsEvaluated);
+    fprintf(out, "pairs pruned       %lld\n", S->pairsPruned);
+    fprintf(out, "peak RSS           %ld KB\n", peakRSS());
+}
+
+void stats_printJSON(FILE *out, struct runStats *S) {
+    fprintf(out, "{\"phases\": {");
+    for (int i = 0; i < PHASES; i++) {
+        fprintf(out, "%s\"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}", i ? ", " : "", phaseKeys[i],
+                S->wall[i] * 1e3, S->cpu[i] * 1e-6);
+    }
+    fprintf(out, "}, \"files\": %d, \"duplicate_files\": %d, \"bytes_read\": %lld, \"tokens\": %lld, \"distinct_words\": %lld, "
+                 "\"mean_distinct_words\": %.1f, \"max_distinct_words\": %d, \"pairs_evaluated\": %lld, "
+                 "\"pairs_pruned\": %lld, \"peak_rss_kb\": %ld}\n",
+            S->files, S->duplicates, S->bytesRead, S->tokens, S->distinctWords,
+            S->files > 0 ? (double) S->distinctWords / S->files : 0.0, S->maxDistinctWords,
+            S->pairsEvaluated, S->pairsPruned, peakRSS());
+}
+
+// ------------------------------- END OF RUN STATISTICS -------------------------------
 
+// bench.c includes this file with BENCHMARK defined and has a main() of its own
+#ifndef BENCHMARK
 int main(int argc, char *argv[]) {
 
+    vocabulary_init(&vocab);
+    JSDkernel_select();
+
     if (DEBUG_FILEHANDLING) {
+        struct pathStore paths;
+        pathStore_init(&paths);
         struct queue Q;
-        queue_init(&Q);
+        queue_init(&Q, &paths);
+        // no walkers, only the files named directly end up in the queue
+        struct walkPool walks;
+        walkPool_init(&walks, 1, &Q, DEFAULTSUFFIX, WS_DEFAULT);
 
         for (int i = 1; i < argc; i++) {
             //check for non-thread parameters
             if (argv[i][0] != '-') {
-                fileManager(&Q, argv[i]);
+                fileManager(&Q, &walks, argv[i]);
             }
         }
 
         queuePrint(&Q);
+        walkPool_destroy(&walks);
     }
 
     if (PRODUCTIONTEST) {
@@ -920,11 +3258,47 @@ int main(int argc, char *argv[]) {
 //            return EXIT_FAILURE;
 //        }
 
+        // everything not named here is off
+        struct options opts = {
+            .directoryThreads = DEFAULTTHREADS,
+            .fileThreads = DEFAULTTHREADS,
+            .analysisThreads = DEFAULTTHREADS,
+            .suffix = DEFAULTSUFFIX,
+            .maxJSD = INFINITY,
+        };
+        // everything that isn't an option or an option's value is a file or directory
+        char **operands = malloc(argc * sizeof(char *));
+        int operandCount = 0;
+        for (int i = 1; i < argc; i++) {
+            if (argv[i][0] != '-') {
+                operands[operandCount++] = argv[i];
+            }
+            else {
+                int option = i;
+                if (parseOption(argc, argv, &i, &opts) == EXIT_SUCCESS) continue;
+                fprintf(stderr, "BAD PARAMETER: %s\n", argv[option]);
+                free(operands);
+                return EXIT_FAILURE;
+            }
+        }
+
+        // a bad index is turned down before anything is allocated
+        struct WFDindex index = { NULL, 0, NULL };
+        if (opts.indexFile != NULL && WFDindex_open(&index, opts.indexFile) == -1) {
+            free(operands);
+            return EXIT_FAILURE;
+        }
+
         // Queue
-        // WARNING: fixed size queue, probably gonna bite me in the ass for big test cases, but look i got bigger problems right now.
-        // please dont make directories more than ten thousand characters long :)
+        // every path is interned once in the path store, the queues only carry pointers and are drained while they are filled.
+        // a file is only queued once whatever path reached it
+        struct pathStore paths;
+        pathStore_init(&paths);
+        struct inodeSet inputs;
+        inodeSet_init(&inputs);
         struct queue Q;
-        queue_init(&Q);
+        queue_init(&Q, &paths);
+        Q.inodes = &inputs;
         if (DEBUG_QUEUETEST) {
             queue_add(&Q, "69");
             queue_add(&Q, "1337");
@@ -933,89 +3307,234 @@ int main(int argc, char *argv[]) {
 
             queuePrint(&Q);
 
-            char* element = "66";
-            queue_remove(&Q, element);
+            char *element;
+            queue_remove(&Q, &element);
 
             queuePrint(&Q);
         }
 
-        // Find all text files, bfs search.
-        // traverseMain(&Q, "test");
+        if (opts.cacheDirectory != NULL) {
+            if (mkdir(opts.cacheDirectory, 0777) == -1 && errno != EEXIST) {
+                err(1, "can't create %s", opts.cacheDirectory);
+            }
+            WFDcacheDirectory = opts.cacheDirectory;
+        }
 
-        for (int i = 1; i < argc; i++) {
-            //check for non-thread parameters
-            if (argv[i][0] != '-') {
-                fileManager(&Q, argv[i]);
+        struct WFDrepository repo;
+        WFDqueueinit(&repo);
+
+        // loading an index counts as WFD construction
+        double phaseStart = stats_clock(CLOCK_MONOTONIC);
+        double readersStart = phaseStart;
+
+        // indexed documents come first and own the first vocabulary ids, before any reader hands out new ones
+        // an archive's names stay out of the path store: a new version of an archived file is read and compared
+        // with the old one
+        int archived = 0;
+        if (opts.indexFile != NULL) {
+            WFDindex_load(&index, &repo, opts.archive ? NULL : &paths);
+            if (opts.archive) {
+                archived = repo.count;
             }
         }
+        unsigned indexed = repo.count;
+
+        // file readers consume the file queue while the walkers are still filling it
+        struct readerArgs readerArgs = { &Q, &repo };
+        pthread_t *readers = malloc(opts.fileThreads * sizeof(pthread_t));
+        startThreads(readers, opts.fileThreads, fileWorker, &readerArgs, 0);
+        phaseStart = stats_clock(CLOCK_MONOTONIC);
+
+        // walkers share out the subdirectories between them, every one of them has a deque
+        struct walkPool walks;
+        walkPool_init(&walks, opts.directoryThreads, &Q, opts.suffix,
+                      opts.followLinks ? WS_DEFAULT | WS_FOLLOWLINK : WS_DEFAULT);
+        struct walkerArgs *walkerArgs = malloc(opts.directoryThreads * sizeof(struct walkerArgs));
+        for (int i = 0; i < opts.directoryThreads; i++) {
+            walkerArgs[i].pool = &walks;
+            walkerArgs[i].self = i;
+        }
+        pthread_t *walkers = malloc(opts.directoryThreads * sizeof(pthread_t));
+        startThreads(walkers, opts.directoryThreads, directoryWorker, walkerArgs, sizeof(struct walkerArgs));
 
-        if (totalNumberOfFiles < 2) {
+        for (int i = 0; i < operandCount; i++) {
+            fileManager(&Q, &walks, operands[i]);
+        }
+        free(operands);
+
+        // once every walker is done nothing else can reach the file queue
+        walkPool_close(&walks);
+        joinThreads(walkers, opts.directoryThreads);
+        stats.wall[PHASE_TRAVERSAL] = stats_clock(CLOCK_MONOTONIC) - phaseStart;
+        queue_close(&Q);
+        joinThreads(readers, opts.fileThreads);
+        walkPool_destroy(&walks);
+        free(walkerArgs);
+        free(walkers);
+        free(readers);
+
+        WFDqueue_compact(&repo);
+        WFDqueue_sort(&repo, indexed);
+        // from here on a failure still goes through the clean up at the end
+        int status = EXIT_SUCCESS;
+        if (opts.writeIndexFile != NULL && WFDindex_write(opts.writeIndexFile, &repo) == -1) {
+            status = EXIT_FAILURE;
+        }
+        stats.wall[PHASE_WFD] = stats_clock(CLOCK_MONOTONIC) - readersStart;
+        totalNumberOfFiles = repo.count;
+        if (status == EXIT_SUCCESS && totalNumberOfFiles < 2) {
             perror("NEED MORE FILES!\n");
-            return EXIT_FAILURE;
+            status = EXIT_FAILURE;
         }
 
-        if (DEBUG) queuePrint(&Q);
-
-        struct WFDrepository repo;
-        WFDqueueinit(&repo);
+        if (status == EXIT_SUCCESS) {
+            stats.files = repo.count;
+            for (unsigned i = 0; i < repo.count; i++) {
+                stats.tokens += repo.wordCounts[i];
+                stats.distinctWords += repo.data[i].count;
+                if (repo.data[i].count > stats.maxDistinctWords) {
+                    stats.maxDistinctWords = repo.data[i].count;
+                }
+            }
 
-        // READ IN THE QUEUE ONE ELEMENT AT A TIME (NOT MULTITHREADED) AND COMPUTE WFD
-        int count = Q.count;
-        for (int i = 0; i < count; i++) {
-            struct Node *WFD_LL = NULL;
-            WFD_LL = WFDmain(Q.data[i], WFD_LL);
-            insertionSort(&WFD_LL);
-//        printList(WFD_LL);
-            WFDqueue_add(&repo, WFD_LL, Q.data[i]);
-//        destroyList(WFD_LL);
-//        printf("\n===================================================\n\n");
-        }
+            // exact copies leave the pairwise phase, their pairs are filled in from their group's first file
+            stats.duplicates = WFDqueue_group(&repo);
 
 //        WFDqueue_print(&repo);
 
-        if (COMBINATIONGENERATOR) {
-            if (DEBUG) {
-                for (int i = 0; i < repo.count; i++) {
-                    printf("%s\n", repo.fileNames[i]);
+            if (COMBINATIONGENERATOR) {
+                if (DEBUG) {
+                    for (int i = 0; i < repo.count; i++) {
+                        printf("%s\n", repo.fileNames[i]);
+                    }
                 }
-            }
 
 //            printf("\n");
 
-            struct JSDrepository *array = malloc(10000 * sizeof (struct JSDrepository));
-
-            int comboCounter = 0;
-            int comboStart = 0;
-            for (int i = 0; i < repo.count - 1; i++) {
-                comboCounter = comboStart + 1;
-//                printf("FILENAME: %s\n", repo.fileNames[i]);
-                while (comboCounter < repo.count) {
-//                    printf("\t compare to %s\n", repo.fileNames[comboCounter]);
-                    JSDmain(repo.fileNames[i], repo.fileNames[comboCounter], repo.data[i], repo.data[comboCounter], array);
-                    comboCounter++;
+                // the pairwise phases run one after the other, so the process's CPU time is theirs
+                phaseStart = stats_clock(CLOCK_MONOTONIC);
+                double phaseCPU = stats_clock(CLOCK_PROCESS_CPUTIME_ID);
+
+                struct termDocMatrix matrix;
+                termDocMatrix_build(&matrix, &repo, opts.analysisThreads, archived);
+
+                // one tile pair at a time, termDocMatrix_build already made several per thread. with an archive the
+                // pairs start at the first tile holding a new document, the ones before are archive against archive
+                struct pairCursor cursor;
+                long long firstTile = archived / matrix.tileSize;
+                cursor.next = firstTile * (firstTile + 1) / 2;
+                cursor.total = (long long) matrix.tiles * (matrix.tiles + 1) / 2;
+                cursor.chunkSize = 1;
+                pthread_mutex_init(&cursor.lock, NULL);
+
+                // or only the pairs the MinHash filter lets through, several chunks of them per thread
+                unsigned long long *candidates = NULL;
+                if (opts.lshBands > 0) {
+                    cursor.next = 0;
+                    cursor.total = minhash_candidates(&matrix, opts.lshBands, opts.analysisThreads, &candidates);
+                    cursor.chunkSize = cursor.total / (opts.analysisThreads * PAIRCHUNKSPERTHREAD) + 1;
+                    if (DEBUG) {
+                        long long totalPairs = (long long) repo.count * (repo.count - 1) / 2
+                                               - (long long) archived * (archived - 1) / 2;
+                        printf("%lld of %lld pairs pruned\n", totalPairs - cursor.total, totalPairs);
+                    }
                 }
-                comboStart++;
-            }
 
-//            for (int i = 0; i < JSDArrayIndex; i++) {
-//                printf("%s \t|||%d|||\n", array[i].string, array[i].wordCount);
-//            }
-//            printf("%s %d\n", array[2].string, array[2].wordCount);
-            qsort(array, JSDArrayIndex, sizeof( struct JSDrepository ), cmp );
-//            printf("\n");
+                // --top needs every pair before it can print any, so it turns streaming off
+                struct JSDstream stream = { .out = stdout, .repo = &repo };
+                pthread_mutex_init(&stream.lock, NULL);
+                int streaming = opts.stream && opts.top == 0;
+
+                struct analysisArgs *analysisArgs = calloc(opts.analysisThreads, sizeof(struct analysisArgs));
+                for (int i = 0; i < opts.analysisThreads; i++) {
+                    analysisArgs[i].repo = &repo;
+                    analysisArgs[i].matrix = &matrix;
+                    analysisArgs[i].cursor = &cursor;
+                    analysisArgs[i].candidates = candidates;
+                    analysisArgs[i].results.limit = opts.top;
+                    analysisArgs[i].results.maxJSD = opts.maxJSD;
+                    analysisArgs[i].results.stream = streaming ? &stream : NULL;
+                    analysisArgs[i].results.copies = repo.nextCopy;
+                }
+                if (repo.nextCopy != NULL) {
+                    JSDcopies(&repo, &analysisArgs[0].results);
+                }
+                pthread_t *analyzers = malloc(opts.analysisThreads * sizeof(pthread_t));
+                startThreads(analyzers, opts.analysisThreads, analysisWorker, analysisArgs,
+                             sizeof(struct analysisArgs));
+                joinThreads(analyzers, opts.analysisThreads);
+                free(analyzers);
+
+                // merge the per-thread buffers
+                long long kept = 0;
+                for (int i = 0; i < opts.analysisThreads; i++) {
+                    kept += analysisArgs[i].results.count;
+                    stats.pairsEvaluated += analysisArgs[i].results.evaluated;
+                }
+                struct JSDrepository *array = malloc((kept + 1) * sizeof (struct JSDrepository));
+                for (int i = 0; i < opts.analysisThreads; i++) {
+                    // a thread that kept nothing never allocated its buffer
+                    if (analysisArgs[i].results.count > 0) {
+                        memcpy(array + JSDArrayIndex, analysisArgs[i].results.data,
+                               analysisArgs[i].results.count * sizeof(struct JSDrepository));
+                        JSDArrayIndex += analysisArgs[i].results.count;
+                    }
+                    free(analysisArgs[i].results.data);
+                }
+                free(analysisArgs);
+                pthread_mutex_destroy(&cursor.lock);
+                pthread_mutex_destroy(&stream.lock);
+                termDocMatrix_destroy(&matrix);
+                free(candidates);
+
+                stats.pairsPruned = (long long) repo.count * (repo.count - 1) / 2
+                                    - (long long) archived * (archived - 1) / 2 - stats.pairsEvaluated;
+                stats.wall[PHASE_JSD] = stats_clock(CLOCK_MONOTONIC) - phaseStart;
+                stats.cpu[PHASE_JSD] = (stats_clock(CLOCK_PROCESS_CPUTIME_ID) - phaseCPU) * 1e9;
+                phaseStart = stats_clock(CLOCK_MONOTONIC);
+                phaseCPU = stats_clock(CLOCK_PROCESS_CPUTIME_ID);
+
+                // each thread kept its own best K, only the best K of all of them are printed
+                if (opts.top > 0 && JSDArrayIndex > opts.top) {
+                    qsort(array, JSDArrayIndex, sizeof( struct JSDrepository ), cmpSimilarity );
+                    JSDArrayIndex = opts.top;
+                }
+
+                qsort(array, JSDArrayIndex, sizeof( struct JSDrepository ), cmp );
+
+                for (long long i = 0; i < JSDArrayIndex; i++) {
+                    printJSDResult(stdout, &array[i], &repo);
+                }
+                fflush(stdout);
 
-            for (int i = 0; i < JSDArrayIndex; i++) {
-                printf("%s\n", array[i].string);
+                free(array);
+                stats.wall[PHASE_OUTPUT] = stats_clock(CLOCK_MONOTONIC) - phaseStart;
+                stats.cpu[PHASE_OUTPUT] = (stats_clock(CLOCK_PROCESS_CPUTIME_ID) - phaseCPU) * 1e9;
             }
 
-            free(array);
+            if (opts.stats) {
+                stats_print(stderr, &stats);
+            }
+            if (opts.statsFile != NULL) {
+                FILE *out = strcmp(opts.statsFile, "-") ? fopen(opts.statsFile, "w") : stderr;
+                if (out == NULL) {
+                    warn("can't write %s", opts.statsFile);
+                }
+                else {
+                    stats_printJSON(out, &stats);
+                    if (out != stderr) fclose(out);
+                }
+            }
         }
 
         // Clean up WFD repository
-        int WFDdestroyer = repo.count;
-        while(WFDdestroyer >= 0) {
-            destroyList(repo.data[WFDdestroyer]);
-            WFDdestroyer--;
+        WFDqueue_destroy(&repo);
+        WFDindex_close(&index);
+        pathStore_destroy(&paths);
+        inodeSet_destroy(&inputs);
+        vocabulary_destroy(&vocab);
+        if (status != EXIT_SUCCESS) {
+            return status;
         }
     }
 
@@ -1024,56 +3543,27 @@ int main(int argc, char *argv[]) {
         char file1[100] = "test/jsdTest1.txt";
         char file2[100] = "test/jsdTest2.txt";
 
-        struct Node *WFD_LL_1 = NULL;
-        WFD_LL_1 = WFDmain(file1, WFD_LL_1);
+        struct WFD WFD_1, WFD_2;
+        int wordCount1 = WFDmain(file1, &WFD_1);
+        int wordCount2 = WFDmain(file2, &WFD_2);
 
-        insertionSort(&WFD_LL_1);
-
-        struct Node * WFD_LL_2 = NULL;
-        WFD_LL_2 = WFDmain(file2, WFD_LL_2);
-
-        insertionSort(&WFD_LL_2);
-
-//        JSDhelper(WFD_LL_1, WFD_LL_2, file1, file2, );
-//        printList(WFD_LL_1);
-//        printf("\n");
-//        printList(WFD_LL_2);
+        struct JSDbuffer results = { .maxJSD = INFINITY };
+        JSDhelper(&WFD_1, &WFD_2, 0, 1, wordCount1, wordCount2, &results);
+        printf("%f %s %s\n", results.data[0].JSD, file1, file2);
+        free(results.data);
 
-        destroyList(WFD_LL_1);
-        destroyList(WFD_LL_2);
+        WFD_destroy(&WFD_1);
+        WFD_destroy(&WFD_2);
     }
 
     // DEBUG WFD
     if (DEBUG_WFD) {
-        struct Node *WFD_LL = NULL;
-        WFD_LL = WFDmain("test/textFile1.txt", WFD_LL);
-
-        printList(WFD_LL);
-        insertionSort(&WFD_LL);
-        printf("================\n");
-        printList(WFD_LL);
-        destroyList(WFD_LL);
-    }
-
-    // Playing around with how a insertionsort linked list works
-    if (DEBUG_LLTEST) {
-        struct Node *a = NULL;
-        push(&a, "apple", a, 5);
-        push(&a, "zee", a, 5);
-        push(&a, "dad", a,5);
-        push(&a, "cow", a,5);
-        push(&a, "zzz", a,5);
-        push(&a, "zee", a,5);
-
-        printf("Linked List before sorting \n");
-        printList(a);
-
-        insertionSort(&a);
-
-        printf("\nLinked List after sorting \n");
-        printList(a);
+        struct WFD wfd;
+        WFDmain("test/textFile1.txt", &wfd);
 
-        destroyList(a);
+        printWFD(&wfd);
+        WFD_destroy(&wfd);
     }
 
 }
+#endif